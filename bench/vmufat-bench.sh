@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# vmufat-bench.sh - time mkfs.vmufat phases at every -B size
+#
+# Usage: vmufat-bench.sh [path-to-mkfs.vmufat] [extra mkfs.vmufat options]
+#
+# Formats an image on tmpfs at each power-of-two size from 2^MINLOG to
+# 2^MAXLOG blocks (default 2 to 16, every size -B accepts that keeps
+# block numbers in 16 bits) and prints the per-phase figures from -b.
+# Run as root with losetup available to repeat the run on loop devices.
+
+MKFS=${1:-./mkfs.vmufat}
+[ $# -gt 0 ] && shift
+MINLOG=${MINLOG:-2}
+MAXLOG=${MAXLOG:-16}
+TMPFS=${TMPFS:-/dev/shm}
+
+if [ ! -x "$MKFS" ]; then
+	echo "Cannot run $MKFS" >&2
+	exit 1
+fi
+
+IMAGE=$(mktemp "$TMPFS/vmufat-bench.XXXXXX") || exit 1
+LOOP=
+cleanup() {
+	[ -n "$LOOP" ] && losetup -d "$LOOP"
+	rm -f "$IMAGE"
+}
+trap cleanup EXIT INT TERM
+
+log=$MINLOG
+while [ "$log" -le "$MAXLOG" ]; do
+	blocks=$((1 << log))
+	truncate -s 0 "$IMAGE"
+	truncate -s $((blocks * 512)) "$IMAGE"
+
+	echo "== tmpfs image, $blocks blocks (-B $log)"
+	"$MKFS" -f -b "$@" -B "$log" "$IMAGE" || exit 1
+
+	if [ "$(id -u)" -eq 0 ] && command -v losetup >/dev/null 2>&1 \
+		&& LOOP=$(losetup -f --show "$IMAGE" 2>/dev/null); then
+		echo "== loop device $LOOP, $blocks blocks (-B $log)"
+		"$MKFS" -b "$@" -B "$log" "$LOOP" || echo "loop run failed" >&2
+		losetup -d "$LOOP"
+		LOOP=
+	fi
+	log=$((log + 1))
+done
@@ -0,0 +1,1789 @@
+/*
+ * libvmufat.c - lay out and write VMUFAT volumes
+ *
+ * Copyright (c) 2012 Adrian McMenamin adrianmcmenamin@gmail.com
+ * Licensed under Version 2 of the GNU General Public Licence
+ *
+ * Parts shamelessly copied from other mkfs code
+ * copyright Linus Torvalds and others
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <asm/byteorder.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libvmufat.h"
+
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+
+/* Blocks covered by each write when zeroing the volume */
+static const int ZEROEXTENT = 2048;
+/*
+ * Surface scan requests start at SCANEXTENT blocks, halve on errors or
+ * reads SLOWFACTOR times slower than usual, but not below MINSCANEXTENT,
+ * and double again after HEALTHYREADS good reads in a row.
+ */
+static const unsigned int SCANEXTENT = 1024;
+static const unsigned int MINSCANEXTENT = 8;
+static const int SLOWFACTOR = 8;
+static const int HEALTHYREADS = 16;
+static const int SCANTHREADS = 4;
+/* Most memory given to queued scan reads with io_uring */
+static const size_t SCANMEMORY = 32 << 20;
+/* Deepest io_uring queue we will ask for */
+static const unsigned int MAXDEPTH = 4096;
+/* Written and read back over every block by vmufat_writetest(), in turn */
+static const unsigned char PATTERNS[] = { 0xaa, 0x55, 0xff, 0x00 };
+#define NPATTERNS (sizeof(PATTERNS) / sizeof(PATTERNS[0]))
+/* Blocks compared at a time when verifying */
+static const int VERIFYEXTENT = 128;
+
+/*
+ * The stock 128KiB VMU, laid out as calculate_vmuparams() would: the
+ * directory runs down from block 253 to 240, the FAT is block 254 and
+ * the root block 255. Its system image is built in, see STDIMAGE.
+ */
+#define STDBLOCKS 256
+#define STDDIRSIZE 14
+#define STDDIRLOW (STDBLOCKS - 2 - STDDIRSIZE)
+static const struct vmuparam STDPARAM = {
+	.size = STDBLOCKS * 512,
+	.rootblock = STDBLOCKS - 1,
+	.fatstart = STDBLOCKS - 2,
+	.fatsize = 1,
+	.dirstart = STDBLOCKS - 3,
+	.dirsize = STDDIRSIZE,
+};
+
+/* What one scan thread or ring slot is reading */
+struct scanslot {
+	/* UINT_MAX when idle */
+	unsigned int start;
+	unsigned int count;
+	struct timespec issued;
+};
+
+/* Work shared between the surface scan threads */
+struct scanjob {
+	struct vmudev *dev;
+	struct vmubadblocks *set;
+	unsigned int next;
+	/* Current request size, and the reads it is judged against */
+	unsigned int extent;
+	int healthy;
+	double readsecs;
+	struct scanslot *slot;
+	unsigned int slots;
+	/*
+	 * An extent of the pattern for this pass of a write test, else
+	 * NULL; writing says whether the pass writes it or reads it back
+	 */
+	const char *pattern;
+	int writing;
+	const struct vmuscan *scan;
+	int error;
+	/* Smallest read or write, in blocks: a sector under O_DIRECT */
+	unsigned int unit;
+	pthread_mutex_t lock;
+};
+
+static const unsigned int LONGBITS = 8 * sizeof(unsigned long);
+
+int vmufat_init_badblocks(struct vmubadblocks *set, unsigned int blocks)
+{
+	set->blocks = blocks;
+	set->count = 0;
+	set->map = calloc((blocks + LONGBITS - 1) / LONGBITS,
+		sizeof(unsigned long));
+	if (!set->map)
+		return -ENOMEM;
+	return 0;
+}
+
+void vmufat_clean_badblocks(struct vmubadblocks *set)
+{
+	free(set->map);
+	set->map = NULL;
+}
+
+/* Returns 1 if the block is newly noted, 0 if known or out of range */
+int vmufat_add_badblock(struct vmubadblocks *set, unsigned long block)
+{
+	unsigned long bit;
+
+	if (block >= set->blocks)
+		return 0;
+	bit = 1UL << (block % LONGBITS);
+	if (set->map[block / LONGBITS] & bit)
+		return 0;
+	set->map[block / LONGBITS] |= bit;
+	set->count++;
+	return 1;
+}
+
+/* Note blocks first to last inclusively; returns how many were new */
+unsigned int vmufat_add_badblocks(struct vmubadblocks *set, unsigned long first,
+	unsigned long last)
+{
+	unsigned long word, mask;
+	unsigned int added = 0;
+
+	if (first >= set->blocks || last < first)
+		return 0;
+	if (last >= set->blocks)
+		last = set->blocks - 1;
+	for (word = first / LONGBITS; word <= last / LONGBITS; word++) {
+		mask = ~0UL;
+		if (word == first / LONGBITS)
+			mask &= ~0UL << (first % LONGBITS);
+		if (word == last / LONGBITS)
+			mask &= ~0UL >> (LONGBITS - 1 - last % LONGBITS);
+		added += __builtin_popcountl(mask & ~set->map[word]);
+		set->map[word] |= mask;
+	}
+	set->count += added;
+	return added;
+}
+
+/* First bad block at or above from, or set->blocks if there is none */
+unsigned int vmufat_next_badblock(const struct vmubadblocks *set,
+	unsigned int from)
+{
+	unsigned int word;
+	unsigned long bits;
+
+	if (from >= set->blocks)
+		return set->blocks;
+	word = from / LONGBITS;
+	bits = set->map[word] & (~0UL << (from % LONGBITS));
+	while (!bits) {
+		if (++word >= (set->blocks + LONGBITS - 1) / LONGBITS)
+			return set->blocks;
+		bits = set->map[word];
+	}
+	from = word * LONGBITS + __builtin_ctzl(bits);
+	return from < set->blocks ? from : set->blocks;
+}
+
+/* Safe to call from any of the scan threads */
+static void _count_io(struct vmudev *dev, unsigned long syscalls,
+	unsigned long long bytesread, unsigned long long byteswritten)
+{
+	__atomic_fetch_add(&dev->count.syscalls, syscalls, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&dev->count.bytesread, bytesread, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&dev->count.byteswritten, byteswritten,
+		__ATOMIC_RELAXED);
+}
+
+double vmufat_elapsed_seconds(const struct timespec *since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec)
+		+ (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+/*
+ * Note one read or write request. since is when a synchronous request
+ * was issued, for the latency histogram, or NULL for queued requests
+ * whose individual latency we do not see.
+ */
+static void _count_op(struct vmudev *dev, int write,
+	const struct timespec *since)
+{
+	double usec;
+	int bucket = 0;
+
+	__atomic_fetch_add(write ? &dev->count.writes : &dev->count.reads, 1,
+		__ATOMIC_RELAXED);
+	if (!since)
+		return;
+	usec = vmufat_elapsed_seconds(since) * 1e6;
+	while (usec >= 2 && bucket < VMU_LATBUCKETS - 1) {
+		usec /= 2;
+		bucket++;
+	}
+	__atomic_fetch_add(&dev->count.latency[bucket], 1, __ATOMIC_RELAXED);
+}
+
+int vmufat_sync_device(struct vmudev *dev)
+{
+	struct timespec began;
+	int error;
+
+	clock_gettime(CLOCK_MONOTONIC, &began);
+	error = fdatasync(dev->fd) < 0 ? -errno : 0;
+	_count_io(dev, 1, 0, 0);
+	dev->count.fsyncs++;
+	dev->count.fsyncnsec += vmufat_elapsed_seconds(&began) * 1e9;
+	return error;
+}
+
+static unsigned int _round_down(unsigned int x)
+{
+	unsigned int y = 0x80000000;
+	while (y > x)
+		y = y >> 1;
+	return y;
+}
+
+/*
+ * Under O_DIRECT an image file's sectors are whatever alignment its
+ * filesystem wants for direct I/O, where the kernel will say.
+ */
+static void _probe_file(struct vmudev *dev)
+{
+#ifdef STATX_DIOALIGN
+	struct statx filestat;
+
+	_count_io(dev, 1, 0, 0);
+	if (statx(dev->fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &filestat) < 0
+		|| !(filestat.stx_mask & STATX_DIOALIGN))
+		return;
+	if (filestat.stx_dio_offset_align > VMU_BLOCKSIZE)
+		dev->logical = filestat.stx_dio_offset_align;
+	dev->physical = dev->logical;
+#endif
+}
+
+/*
+ * st_size is 0 for a block device, so ask the block layer for the size
+ * and sector sizes. Image files are taken to have 512-octet sectors.
+ */
+int vmufat_probe_device(struct vmudev *dev)
+{
+	struct stat devstat;
+	uint64_t size;
+	int logical;
+
+	_count_io(dev, 1, 0, 0);
+	if (fstat(dev->fd, &devstat) < 0)
+		return -errno;
+	dev->isblk = S_ISBLK(devstat.st_mode);
+	dev->size = devstat.st_size;
+	dev->logical = VMU_BLOCKSIZE;
+	dev->physical = VMU_BLOCKSIZE;
+	if (!dev->isblk) {
+		if (dev->direct)
+			_probe_file(dev);
+		return 0;
+	}
+
+	_count_io(dev, 3, 0, 0);
+	if (ioctl(dev->fd, BLKGETSIZE64, &size) < 0)
+		return -errno;
+	dev->size = size;
+	if (ioctl(dev->fd, BLKSSZGET, &logical) == 0 && logical > VMU_BLOCKSIZE)
+		dev->logical = logical;
+	if (ioctl(dev->fd, BLKPBSZGET, &dev->physical) < 0
+		|| dev->physical < dev->logical)
+		dev->physical = dev->logical;
+	return 0;
+}
+
+/*
+ * Lay out a volume of blocknum blocks, or of the whole device when
+ * blocknum is 0 - but no more than VMU_MAXBLOCKS, as far as the 16-bit
+ * root block and FAT can reach. Fails with -EFBIG if blocknum asks for
+ * more, and -ENOSPC if it will not fit or is too small to hold a volume.
+ */
+int calculate_vmuparams(const struct vmudev *dev, struct vmuparam *param,
+	int blocknum)
+{
+	off_t size = dev->size;
+
+	if (blocknum < 0 || blocknum > VMU_MAXBLOCKS)
+		return -EFBIG;
+	if ((size < VMU_BLOCKSIZE * 4) || (blocknum > 0 && blocknum < 4)
+		|| size < (off_t)blocknum * VMU_BLOCKSIZE)
+		return -ENOSPC;
+	if (blocknum)
+		size = blocknum * VMU_BLOCKSIZE;
+	else if (size > (off_t)VMU_MAXBLOCKS * VMU_BLOCKSIZE)
+		size = (off_t)VMU_MAXBLOCKS * VMU_BLOCKSIZE;
+
+	if (_round_down(size >> VMU_BLOCKSHIFT) == STDBLOCKS) {
+		*param = STDPARAM;
+		return 0;
+	}
+	param->size = _round_down(size >> VMU_BLOCKSHIFT) << VMU_BLOCKSHIFT;
+	param->rootblock = (param->size >> VMU_BLOCKSHIFT) - 1;
+	param->fatstart = param->rootblock - 1;
+	param->fatsize = (2 * (param->size >> VMU_BLOCKSHIFT))
+		>> VMU_BLOCKSHIFT;
+	if (param->fatsize < 1)
+		param->fatsize = 1;
+	param->dirstart = param->fatstart - param->fatsize;
+	/* Remainder divided in ratio 16:1 between user blocks and directory */
+	param->dirsize = ((param->size >> VMU_BLOCKSHIFT)
+		- (1 + param->fatsize)) / 17;
+	if (param->dirsize < 1)
+		param->dirsize = 1;
+	return 0;
+}
+
+static char _i2bcd(unsigned int i)
+{
+	char bcd;
+	unsigned int digit;
+	digit = i/10;
+	bcd = digit << 4;
+	digit = i % 10;
+	bcd += digit;
+	return bcd;
+}
+
+/*
+ * The system image runs from block lowest - the bottom of the directory,
+ * or of the files below it from vmufat_data_base() - to the root block, padded
+ * down with user blocks to start on a multiple of align blocks so no
+ * write has to straddle a physical sector.
+ */
+unsigned int vmufat_system_image_blocks(const struct vmuparam *param,
+	unsigned int lowest, unsigned int align)
+{
+	return param->rootblock + 1 - (lowest - lowest % align);
+}
+
+/* buffer must hold vmufat_system_image_blocks() blocks; it is not cleared */
+void vmufat_init_system_image(struct vmuimage *image,
+	const struct vmuparam *param, unsigned int lowest, unsigned int align,
+	char *buffer)
+{
+	image->buffer = buffer;
+	image->firstblock = lowest - lowest % align;
+	image->blocks = param->rootblock + 1 - image->firstblock;
+}
+
+char *vmufat_image_block(const struct vmuimage *image, unsigned int block)
+{
+	return image->buffer + (block - image->firstblock) * VMU_BLOCKSIZE;
+}
+
+/* Copy golden into image, which may start lower; the padding is zeroed */
+void vmufat_copy_system_image(struct vmuimage *image,
+	const struct vmuimage *golden)
+{
+	memset(image->buffer, 0,
+		(golden->firstblock - image->firstblock) * VMU_BLOCKSIZE);
+	memcpy(vmufat_image_block(image, golden->firstblock), golden->buffer,
+		golden->blocks * VMU_BLOCKSIZE);
+}
+
+/* Fill count FAT entries by doubling up what is already written */
+static void _fill_entries(uint16_t *buf, uint16_t value, unsigned int count)
+{
+	unsigned int done;
+
+	if (!count)
+		return;
+	buf[0] = __cpu_to_le16(value);
+	for (done = 1; done < count; done *= 2)
+		memcpy(buf + done, buf,
+			(count - done < done ? count - done : done) * 2);
+}
+
+/* Chain blocks last down to first: every entry points one block lower */
+static void _fill_chain(uint16_t *buf, unsigned int first, unsigned int last)
+{
+	unsigned int i;
+
+	buf[first] = __cpu_to_le16(0xFFFA);
+	for (i = first + 1; i <= last; i++)
+		buf[i] = __cpu_to_le16(i - 1);
+}
+
+int mark_fat(struct vmuimage *image, const struct vmuparam *param)
+{
+	uint16_t *buf;
+	unsigned int entries, dirlow, fatlow;
+
+	/* The FAT runs upwards from dirstart + 1, one entry per block */
+	buf = (uint16_t *)vmufat_image_block(image, param->dirstart + 1);
+	entries = param->fatsize * VMU_BLOCKSIZE / 2;
+	dirlow = param->dirstart + 1 - param->dirsize;
+	fatlow = param->fatstart + 1 - param->fatsize;
+
+	/* User blocks are free */
+	_fill_entries(buf, 0xFFFC, dirlow);
+	_fill_chain(buf, dirlow, param->dirstart);
+	_fill_chain(buf, fatlow, param->fatstart);
+	/* Root or unreachable blocks */
+	_fill_entries(buf + param->rootblock, 0xFFFA,
+		entries - param->rootblock);
+	return 0;
+}
+
+/* Everything in the root block but the timestamp; buf must be zeroed */
+void fill_root_block(char *buf, const struct vmuparam *param)
+{
+	int i;
+	uint16_t *wordbuf;
+
+	wordbuf = (uint16_t *)buf;
+
+	for (i = 0; i < 0x10; i++)
+		buf[i] = 0x55;
+
+	wordbuf[0x20] = __cpu_to_le16(param->rootblock);
+	wordbuf[0x22] = __cpu_to_le16(param->rootblock);
+	wordbuf[0x23] = __cpu_to_le16(param->fatstart);
+	wordbuf[0x24] = __cpu_to_le16(param->fatsize);
+	wordbuf[0x25] = __cpu_to_le16(param->dirstart);
+	wordbuf[0x26] = __cpu_to_le16(param->dirsize);
+	/* 32 octets per directory entry */
+	wordbuf[0x27] = __cpu_to_le16(param->dirsize * 8);
+}
+
+/* A directory block chains to the one below it */
+#define STDCHAIN(block) [block] = __cpu_to_le16((block) - 1)
+
+/*
+ * The directory, FAT and (untimestamped) root block of STDPARAM, as
+ * mark_fat() and mark_root_block() would build them, but worked out by
+ * the compiler. The root block is written as words, so its 0x55 fill
+ * bytes are pairs of them.
+ */
+static const struct {
+	char directory[STDDIRSIZE][512];
+	uint16_t fat[STDBLOCKS];
+	uint16_t root[256];
+} STDIMAGE = {
+	.fat = {
+		[0 ... STDDIRLOW - 1] = __cpu_to_le16(VMU_FAT_FREE),
+		[STDDIRLOW] = __cpu_to_le16(VMU_FAT_END),
+		STDCHAIN(241), STDCHAIN(242), STDCHAIN(243), STDCHAIN(244),
+		STDCHAIN(245), STDCHAIN(246), STDCHAIN(247), STDCHAIN(248),
+		STDCHAIN(249), STDCHAIN(250), STDCHAIN(251), STDCHAIN(252),
+		STDCHAIN(253),
+		[STDBLOCKS - 2 ... STDBLOCKS - 1] = __cpu_to_le16(VMU_FAT_END),
+	},
+	.root = {
+		[0 ... 7] = 0x5555,
+		[0x20] = __cpu_to_le16(STDBLOCKS - 1),
+		[0x22] = __cpu_to_le16(STDBLOCKS - 1),
+		[0x23] = __cpu_to_le16(STDBLOCKS - 2),
+		[0x24] = __cpu_to_le16(1),
+		[0x25] = __cpu_to_le16(STDBLOCKS - 3),
+		[0x26] = __cpu_to_le16(STDDIRSIZE),
+		[0x27] = __cpu_to_le16(STDDIRSIZE * 8),
+	},
+};
+
+/*
+ * For the stock geometry, copy in the built-in directory, FAT and root
+ * block in place of mark_root_block() and mark_fat(); image must start
+ * no higher than the directory. Fails with -ENOENT for other sizes.
+ */
+int vmufat_standard_system_image(struct vmuimage *image,
+	const struct vmuparam *param)
+{
+	if (param->size != STDPARAM.size || image->firstblock > STDDIRLOW)
+		return -ENOENT;
+	memcpy(vmufat_image_block(image, STDDIRLOW), &STDIMAGE,
+		sizeof(STDIMAGE));
+	return 0;
+}
+
+/* Eight octets of BCD time, as the root block and directory hold it */
+static void _bcd_time(char *buf, time_t rawtime)
+{
+	struct tm tm;
+	char century, year, month, day, hour, minute, second, weekday;
+
+	if (!gmtime_r(&rawtime, &tm))
+		return;
+	century = _i2bcd(19 + tm.tm_year / 100);
+	year = _i2bcd(tm.tm_year - (tm.tm_year /100) * 100);
+	month = _i2bcd(tm.tm_mon + 1);
+	day = _i2bcd(tm.tm_mday);
+	hour = _i2bcd(tm.tm_hour);
+	minute = _i2bcd(tm.tm_min);
+	second = _i2bcd(tm.tm_sec);
+	weekday = _i2bcd(tm.tm_wday);
+
+	buf[0] = century;
+	buf[1] = year;
+	buf[2] = month;
+	buf[3] = day;
+	buf[4] = hour;
+	buf[5] = minute;
+	buf[6] = second;
+	buf[7] = weekday;
+}
+
+int mark_root_block(struct vmuimage *image, const struct vmuparam *param)
+{
+	fill_root_block(vmufat_image_block(image, param->rootblock), param);
+	return 0;
+}
+
+/* The BCD creation time is the only part of the root block that varies */
+int vmufat_stamp_root_block(struct vmuimage *image,
+	const struct vmuparam *param)
+{
+	_bcd_time(vmufat_image_block(image, param->rootblock) + 0x30,
+		time(NULL));
+	return 0;
+}
+
+/* Fails with -EIO if a bad block falls in the directory, FAT or root */
+int mark_bad_blocks(struct vmuimage *image, const struct vmubadblocks *set,
+	const struct vmuparam *param)
+{
+	unsigned int nobadblock, dirlow;
+	uint16_t *buf;
+
+	if (!set->count)
+		return 0;
+
+	dirlow = param->dirstart + 1 - param->dirsize;
+	if (vmufat_next_badblock(set, dirlow) < set->blocks)
+		return -EIO;
+
+	buf = (uint16_t *)vmufat_image_block(image, param->dirstart + 1);
+	for (nobadblock = vmufat_next_badblock(set, 0);
+		nobadblock < dirlow;
+		nobadblock = vmufat_next_badblock(set, nobadblock + 1))
+		buf[nobadblock] = __cpu_to_le16(0xFFFA);
+	return 0;
+}
+
+/*
+ * Lowest block from which blocks good user blocks run up to the
+ * directory, or UINT_MAX if there are not that many. The directory's
+ * own lowest block when blocks is 0.
+ */
+unsigned int vmufat_data_base(const struct vmuparam *param,
+	const struct vmubadblocks *set, unsigned int blocks)
+{
+	unsigned int block = param->dirstart + 1 - param->dirsize;
+
+	while (blocks) {
+		if (!block--)
+			return UINT_MAX;
+		if (vmufat_next_badblock(set, block) != block)
+			blocks--;
+	}
+	return block;
+}
+
+/* The FAT entry for block: the next block of its file, or VMU_FAT_END */
+unsigned int vmufat_fat_next(const struct vmuimage *image,
+	const struct vmuparam *param, unsigned int block)
+{
+	uint16_t *buf = (uint16_t *)vmufat_image_block(image,
+		param->dirstart + 1);
+
+	return __le16_to_cpu(buf[block]);
+}
+
+/*
+ * Give a data file of length octets the free blocks upwards from
+ * *cursor, chained in that order, and a directory entry. name is at
+ * most twelve octets. Its first block goes in *start and *cursor moves
+ * past the last. Fails with -ENOSPC if the blocks or the directory run
+ * out before the file is placed.
+ */
+int vmufat_add_file(struct vmuimage *image, const struct vmuparam *param,
+	const char *name, size_t length, time_t mtime, unsigned int *cursor,
+	unsigned int *start)
+{
+	uint16_t *buf = (uint16_t *)vmufat_image_block(image,
+		param->dirstart + 1);
+	unsigned int dirlow = param->dirstart + 1 - param->dirsize;
+	unsigned int size, blocks, block, last, slot;
+	char *entry = NULL;
+	size_t namelength = strlen(name);
+
+	size = (length + VMU_BLOCKSIZE - 1) / VMU_BLOCKSIZE;
+	if (!size)
+		size = 1;
+	if (namelength > 12 || size > 0xFFFF)
+		return -EINVAL;
+
+	/* 16 entries in each directory block, from dirstart down */
+	for (slot = 0; slot < param->dirsize * 16; slot++) {
+		entry = vmufat_image_block(image, param->dirstart - slot / 16)
+			+ (slot % 16) * 32;
+		if (!entry[0])
+			break;
+	}
+	if (slot == param->dirsize * 16)
+		return -ENOSPC;
+
+	/* Make sure of the room before changing anything */
+	for (block = *cursor, blocks = 0; blocks < size && block < dirlow;
+		block++)
+		if (__le16_to_cpu(buf[block]) == VMU_FAT_FREE)
+			blocks++;
+	if (blocks < size)
+		return -ENOSPC;
+
+	for (block = *cursor, last = UINT_MAX; size; block++) {
+		if (__le16_to_cpu(buf[block]) != VMU_FAT_FREE)
+			continue;
+		if (last == UINT_MAX)
+			*start = block;
+		else
+			buf[last] = __cpu_to_le16(block);
+		last = block;
+		size--;
+	}
+	buf[last] = __cpu_to_le16(VMU_FAT_END);
+	*cursor = last + 1;
+
+	memset(entry, 0, 32);
+	/* A data file, which may be copied */
+	entry[0x00] = 0x33;
+	*(uint16_t *)(entry + 0x02) = __cpu_to_le16(*start);
+	memcpy(entry + 0x04, name, namelength);
+	_bcd_time(entry + 0x10, mtime);
+	*(uint16_t *)(entry + 0x18) = __cpu_to_le16(blocks);
+	return 0;
+}
+
+/*
+ * Write length octets at start. With repeat set the same buflen octets
+ * go out over and over (zeroes); otherwise buffer is written straight
+ * through, at most buflen octets at a time.
+ */
+static int _pwrite_extent(struct vmudev *dev, const char *buffer,
+	size_t buflen, off_t start, off_t length, int repeat)
+{
+	ssize_t written;
+	size_t chunk;
+	struct timespec began;
+
+	while (length > 0) {
+		chunk = length < buflen ? length : buflen;
+		clock_gettime(CLOCK_MONOTONIC, &began);
+		written = pwrite(dev->fd, buffer, chunk, start);
+		_count_op(dev, 1, &began);
+		_count_io(dev, 1, 0, written > 0 ? written : 0);
+		if (written <= 0)
+			return written < 0 ? -errno : -EIO;
+		if (!repeat)
+			buffer += written;
+		start += written;
+		length -= written;
+	}
+	return 0;
+}
+
+#ifdef HAVE_IO_URING
+void vmufat_close_ring(struct vmuring *ring)
+{
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqeslen);
+	if (ring->cqring && ring->cqring != MAP_FAILED
+		&& ring->cqring != ring->sqring)
+		munmap(ring->cqring, ring->cqlen);
+	if (ring->sqring && ring->sqring != MAP_FAILED)
+		munmap(ring->sqring, ring->sqlen);
+	close(ring->fd);
+}
+
+int vmufat_open_ring(struct vmuring *ring, unsigned int depth)
+{
+	struct io_uring_params params;
+	char *sq, *cq;
+	int error;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&params, 0, sizeof(params));
+	if (depth > MAXDEPTH)
+		depth = MAXDEPTH;
+	ring->fd = syscall(__NR_io_uring_setup, depth, &params);
+	if (ring->fd < 0)
+		return -errno;
+	ring->depth = params.sq_entries;
+
+	ring->sqlen = params.sq_off.array
+		+ params.sq_entries * sizeof(unsigned int);
+	ring->cqlen = params.cq_off.cqes
+		+ params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cqlen > ring->sqlen)
+			ring->sqlen = ring->cqlen;
+	}
+	ring->sqring = mmap(NULL, ring->sqlen, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sqring == MAP_FAILED)
+		goto fail;
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cqring = ring->sqring;
+	else
+		ring->cqring = mmap(NULL, ring->cqlen, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd,
+			IORING_OFF_CQ_RING);
+	if (ring->cqring == MAP_FAILED)
+		goto fail;
+	ring->sqeslen = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqeslen, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto fail;
+
+	sq = ring->sqring;
+	cq = ring->cqring;
+	ring->sqhead = (unsigned int *)(sq + params.sq_off.head);
+	ring->sqtail = (unsigned int *)(sq + params.sq_off.tail);
+	ring->sqmask = (unsigned int *)(sq + params.sq_off.ring_mask);
+	ring->sqarray = (unsigned int *)(sq + params.sq_off.array);
+	ring->cqhead = (unsigned int *)(cq + params.cq_off.head);
+	ring->cqtail = (unsigned int *)(cq + params.cq_off.tail);
+	ring->cqmask = (unsigned int *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	return 0;
+
+fail:
+	error = -errno;
+	vmufat_close_ring(ring);
+	return error;
+}
+
+/* Queue one read or write; it goes to the kernel on the next wait */
+static void _ring_prep(struct vmuring *ring, int opcode, int fd,
+	const void *buffer, unsigned int length, off_t offset,
+	uint64_t data)
+{
+	unsigned int tail = *ring->sqtail;
+	unsigned int index = tail & *ring->sqmask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buffer;
+	sqe->len = length;
+	sqe->off = offset;
+	sqe->user_data = data;
+	ring->sqarray[index] = index;
+	__atomic_store_n(ring->sqtail, tail + 1, __ATOMIC_RELEASE);
+	ring->queued++;
+}
+
+/* Submit anything queued and collect one completion, despite signals */
+static int _ring_wait(struct vmudev *dev, struct io_uring_cqe *cqe)
+{
+	struct vmuring *ring = dev->ring;
+	unsigned int head;
+	int submitted;
+
+	while (1) {
+		head = *ring->cqhead;
+		if (head != __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE)) {
+			*cqe = ring->cqes[head & *ring->cqmask];
+			__atomic_store_n(ring->cqhead, head + 1,
+				__ATOMIC_RELEASE);
+			return 0;
+		}
+		submitted = syscall(__NR_io_uring_enter, ring->fd,
+			ring->queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		_count_io(dev, 1, 0, 0);
+		if (submitted < 0 && errno == EINTR)
+			continue;
+		if (submitted < 0)
+			return -errno;
+		ring->queued -= submitted;
+	}
+}
+
+/*
+ * Collect the completions of everything still in flight, so none of it
+ * can land in a buffer the caller is about to free. Only an error from
+ * io_uring_enter, after which nothing more can be collected, stops it.
+ */
+static void _ring_drain(struct vmudev *dev, unsigned int inflight)
+{
+	struct io_uring_cqe cqe;
+
+	while (inflight && _ring_wait(dev, &cqe) == 0)
+		inflight--;
+}
+
+/* As _pwrite_extent, but with up to the ring depth in flight at once */
+static int _ring_write(struct vmudev *dev, const char *buffer, size_t buflen,
+	off_t start, off_t length, int repeat)
+{
+	struct vmuring *ring = dev->ring;
+	struct io_uring_cqe cqe;
+	off_t next = start, end = start + length, at;
+	unsigned int inflight = 0;
+	size_t chunk;
+	int error = 0, waited;
+
+	while (next < end || inflight) {
+		while (!error && next < end && inflight < ring->depth) {
+			chunk = end - next < buflen ? end - next : buflen;
+			_ring_prep(ring, IORING_OP_WRITE, dev->fd,
+				repeat ? buffer : buffer + (next - start),
+				chunk, next, next);
+			next += chunk;
+			inflight++;
+		}
+		if (!inflight)
+			break;
+		if ((waited = _ring_wait(dev, &cqe)) < 0) {
+			_ring_drain(dev, inflight);
+			return error ? error : waited;
+		}
+		inflight--;
+		at = cqe.user_data;
+		chunk = end - at < buflen ? end - at : buflen;
+		_count_op(dev, 1, NULL);
+		if (cqe.res > 0)
+			_count_io(dev, 0, 0, cqe.res);
+		/* The first failure is the one reported */
+		if (error)
+			continue;
+		if (cqe.res <= 0)
+			error = cqe.res < 0 ? cqe.res : -EIO;
+		/* Finish off a short write the slow way */
+		else if (cqe.res < chunk)
+			error = _pwrite_extent(dev,
+				repeat ? buffer : buffer + (at - start) + cqe.res,
+				buflen, at + cqe.res, chunk - cqe.res, repeat);
+	}
+	return error;
+}
+#else
+void vmufat_close_ring(struct vmuring *ring)
+{
+}
+
+int vmufat_open_ring(struct vmuring *ring, unsigned int depth)
+{
+	return -ENOSYS;
+}
+
+static int _ring_write(struct vmudev *dev, const char *buffer, size_t buflen,
+	off_t start, off_t length, int repeat)
+{
+	return -ENOSYS;
+}
+#endif
+
+/* Extents the io_uring scan keeps in flight */
+static unsigned int _ring_slots(const struct vmuring *ring)
+{
+	unsigned int slots = SCANMEMORY / (SCANEXTENT * VMU_BLOCKSIZE);
+
+	return slots > ring->depth ? ring->depth : slots;
+}
+
+/*
+ * Map buffers for everything the device does, sized for its ring if it
+ * has one, so call this after vmufat_open_ring(). Anonymous memory starts out
+ * zeroed and on a page boundary, which suits any O_DIRECT alignment.
+ */
+int vmufat_open_buffers(struct vmubuffers *buffers, const struct vmudev *dev)
+{
+	size_t zeroes = ZEROEXTENT * VMU_BLOCKSIZE;
+	size_t patterns = NPATTERNS * SCANEXTENT * VMU_BLOCKSIZE;
+
+	buffers->scanslots = SCANTHREADS;
+	if (dev->ring && _ring_slots(dev->ring) > buffers->scanslots)
+		buffers->scanslots = _ring_slots(dev->ring);
+	buffers->length = zeroes + patterns
+		+ (size_t)buffers->scanslots * SCANEXTENT * VMU_BLOCKSIZE;
+	buffers->base = mmap(NULL, buffers->length, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buffers->base == MAP_FAILED)
+		return -errno;
+	buffers->zeroes = buffers->base;
+	buffers->patterns = buffers->zeroes + zeroes;
+	buffers->scan = buffers->patterns + patterns;
+	return 0;
+}
+
+void vmufat_close_buffers(struct vmubuffers *buffers)
+{
+	munmap(buffers->base, buffers->length);
+}
+
+static int _write_extent(struct vmudev *dev, const char *buffer,
+	size_t buflen, off_t start, off_t length, int repeat)
+{
+	if (dev->ring)
+		return _ring_write(dev, buffer, buflen, start, length, repeat);
+	return _pwrite_extent(dev, buffer, buflen, start, length, repeat);
+}
+
+/*
+ * Ask the kernel to zero the extent for us - BLKZEROOUT on a block
+ * device (which the driver may turn into a write-zeroes or discard
+ * command), a punched hole in an image file. Fails if neither is
+ * supported so the caller can write the zeroes itself.
+ */
+static int _zero_offload(struct vmudev *dev, off_t start, off_t length)
+{
+	struct timespec began;
+	uint64_t range[2];
+	int error = -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &began);
+	if (dev->isblk) {
+		range[0] = start;
+		range[1] = length;
+		error = ioctl(dev->fd, BLKZEROOUT, range);
+	}
+	else
+		error = fallocate(dev->fd,
+			FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			start, length);
+	/* No bytes cross the bus, so none are counted as written */
+	_count_op(dev, 1, &began);
+	_count_io(dev, 1, 0, 0);
+	return error < 0 ? -errno : 0;
+}
+
+/*
+ * Tell the device the user area is unused. Unlike zero_blocks() this
+ * makes no promise about what a block device reads back afterwards.
+ */
+int vmufat_discard_blocks(struct vmudev *dev, const struct vmuimage *image)
+{
+	uint64_t range[2];
+	off_t length = (off_t)image->firstblock * VMU_BLOCKSIZE;
+	int error;
+
+	if (dev->isblk) {
+		range[0] = 0;
+		range[1] = length;
+		error = ioctl(dev->fd, BLKDISCARD, range);
+	}
+	else
+		error = fallocate(dev->fd,
+			FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, length);
+	_count_io(dev, 1, 0, 0);
+	return error < 0 ? -errno : 0;
+}
+
+/*
+ * Zero the user area - everything below the system image. Returns 1
+ * if the device did it for us, 0 if we wrote the zeroes.
+ */
+int zero_blocks(struct vmudev *dev, const struct vmuimage *image)
+{
+	char *zilches;
+	int error;
+	off_t length = (off_t)image->firstblock * VMU_BLOCKSIZE;
+
+	if (_zero_offload(dev, 0, length) == 0)
+		return 1;
+	if (dev->buffers)
+		return _write_extent(dev, dev->buffers->zeroes,
+			ZEROEXTENT * VMU_BLOCKSIZE, 0, length, 1);
+
+	zilches = calloc(ZEROEXTENT, VMU_BLOCKSIZE);
+	if (!zilches)
+		return -ENOMEM;
+	error = _write_extent(dev, zilches, ZEROEXTENT * VMU_BLOCKSIZE,
+		0, length, 1);
+	free(zilches);
+	return error;
+}
+
+static void _scan_notify(struct scanjob *job, int event, unsigned int start,
+	unsigned int count)
+{
+	if (job->scan && job->scan->notify)
+		job->scan->notify(job->scan->arg, event, start, count);
+}
+
+static int _scan_read(struct scanjob *job, char *buffer, unsigned int start,
+	unsigned int count)
+{
+	size_t length = count * VMU_BLOCKSIZE;
+	ssize_t got;
+	struct timespec began;
+
+	clock_gettime(CLOCK_MONOTONIC, &began);
+	got = pread(job->dev->fd, buffer, length, (off_t)start * VMU_BLOCKSIZE);
+	_count_op(job->dev, 0, &began);
+	_count_io(job->dev, 1, got > 0 ? got : 0, 0);
+	return got == length ? 0 : -1;
+}
+
+/*
+ * Split a failed extent in half and read each half, down to blocks, or
+ * to whole sectors under O_DIRECT
+ */
+static void _scan_bisect(struct scanjob *job, char *buffer,
+	unsigned int start, unsigned int count)
+{
+	unsigned int half = count / 2 / job->unit * job->unit;
+	unsigned int block;
+
+	if (half) {
+		if (_scan_read(job, buffer, start, half) < 0)
+			_scan_bisect(job, buffer, start, half);
+		if (_scan_read(job, buffer, start + half, count - half) < 0)
+			_scan_bisect(job, buffer, start + half, count - half);
+		return;
+	}
+	pthread_mutex_lock(&job->lock);
+	for (block = start; block < start + count; block++)
+		if (vmufat_add_badblock(job->set, block))
+			_scan_notify(job, VMU_SCAN_BAD, block, 1);
+	pthread_mutex_unlock(&job->lock);
+}
+
+/*
+ * Size the next requests by how the last one went. Request times are
+ * only compared at the same size, so the average starts again whenever
+ * the size changes. Call with the lock held.
+ */
+static void _scan_adapt(struct scanjob *job, const struct scanslot *slot,
+	int failed)
+{
+	double secs = vmufat_elapsed_seconds(&slot->issued);
+
+	if (slot->count != job->extent)
+		return;
+	if (failed || (job->healthy >= 4 && secs > SLOWFACTOR * job->readsecs)) {
+		if (job->extent > MINSCANEXTENT && job->extent > job->unit) {
+			job->extent /= 2;
+			job->readsecs = 0;
+		}
+		job->healthy = 0;
+		return;
+	}
+	job->readsecs = job->healthy ? (job->readsecs * 7 + secs) / 8 : secs;
+	if (++job->healthy >= HEALTHYREADS && job->extent < SCANEXTENT) {
+		job->extent *= 2;
+		job->readsecs = 0;
+		job->healthy = 0;
+	}
+}
+
+/* Hand out the next extent to a thread or slot; call with the lock held */
+static int _scan_take(struct scanjob *job, struct scanslot *slot)
+{
+	if (job->next >= job->set->blocks)
+		return -1;
+	slot->start = job->next;
+	slot->count = job->set->blocks - job->next;
+	if (slot->count > job->extent)
+		slot->count = job->extent;
+	job->next += slot->count;
+	_scan_notify(job, VMU_SCAN_READ, slot->start, slot->count);
+	clock_gettime(CLOCK_MONOTONIC, &slot->issued);
+	return 0;
+}
+
+/* Blocks in the smallest request the device will take */
+static unsigned int _io_unit(const struct vmudev *dev)
+{
+	return dev->direct ? dev->logical / VMU_BLOCKSIZE : 1;
+}
+
+/* Lowest block not yet known to be scanned; call with the lock held */
+static unsigned int _scan_lowwater(const struct scanjob *job)
+{
+	unsigned int i, low = job->next;
+
+	for (i = 0; i < job->slots; i++)
+		if (job->slot[i].start < low)
+			low = job->slot[i].start;
+	return low;
+}
+
+/* An extent is finished with; call with the lock held */
+static void _scan_done(struct scanjob *job, struct scanslot *slot)
+{
+	slot->start = UINT_MAX;
+	_scan_notify(job, VMU_SCAN_PROGRESS, _scan_lowwater(job), 0);
+}
+
+/*
+ * Get a whole write pass out to the media - fdatasync also flushes the
+ * device's own cache - and drop it from the page cache, so the read
+ * pass that follows has to come back from the media.
+ */
+static int _flush_pass(struct vmudev *dev, off_t start, off_t length)
+{
+	int error;
+
+	if ((error = vmufat_sync_device(dev)) < 0)
+		return error;
+	_count_io(dev, 1, 0, 0);
+	return -posix_fadvise(dev->fd, start, length, POSIX_FADV_DONTNEED);
+}
+
+/* Note a block that did not keep what was written; lock not held */
+static void _test_bad(struct scanjob *job, unsigned int block)
+{
+	pthread_mutex_lock(&job->lock);
+	if (vmufat_add_badblock(job->set, block))
+		_scan_notify(job, VMU_SCAN_BAD, block, 1);
+	pthread_mutex_unlock(&job->lock);
+}
+
+/*
+ * Fill buffer with the pass's pattern for count blocks from start, each
+ * block stamped with its own number, so a block the media maps onto
+ * another reads back with the wrong number in it.
+ */
+static void _test_fill(struct scanjob *job, char *buffer,
+	unsigned int start, unsigned int count)
+{
+	unsigned int block;
+	uint32_t stamp;
+
+	memcpy(buffer, job->pattern, count * VMU_BLOCKSIZE);
+	for (block = 0; block < count; block++) {
+		stamp = __cpu_to_le32(start + block);
+		memcpy(buffer + block * VMU_BLOCKSIZE, &stamp, sizeof(stamp));
+	}
+}
+
+/* Check count blocks read back into buffer against what was written */
+static void _test_compare(struct scanjob *job, const char *buffer,
+	unsigned int start, unsigned int count)
+{
+	const char *got;
+	unsigned int block;
+	uint32_t stamp;
+
+	for (block = 0; block < count; block++) {
+		got = buffer + block * VMU_BLOCKSIZE;
+		stamp = __cpu_to_le32(start + block);
+		if (memcmp(got, &stamp, sizeof(stamp)) != 0
+			|| memcmp(got + sizeof(stamp), job->pattern
+			+ sizeof(stamp), VMU_BLOCKSIZE - sizeof(stamp)) != 0)
+			_test_bad(job, start + block);
+	}
+}
+
+/*
+ * One extent of a write test pass: write the pattern over it, or read
+ * it back and check it block by block. When the whole extent cannot be
+ * written or read, it goes a block (or O_DIRECT sector) at a time to
+ * find the ones that fail.
+ */
+static void _test_extent(struct scanjob *job, char *buffer,
+	unsigned int start, unsigned int count)
+{
+	struct vmudev *dev = job->dev;
+	size_t length = job->unit * VMU_BLOCKSIZE;
+	unsigned int block, bad;
+	int failed;
+
+	if (job->writing)
+		_test_fill(job, buffer, start, count);
+	if (job->writing ? _pwrite_extent(dev, buffer, count * VMU_BLOCKSIZE,
+		(off_t)start * VMU_BLOCKSIZE, count * VMU_BLOCKSIZE, 0) == 0
+		: _scan_read(job, buffer, start, count) == 0) {
+		if (!job->writing)
+			_test_compare(job, buffer, start, count);
+		return;
+	}
+
+	for (block = start; block < start + count; block += job->unit) {
+		if (job->writing)
+			failed = _pwrite_extent(dev, buffer
+				+ (block - start) * VMU_BLOCKSIZE, length,
+				(off_t)block * VMU_BLOCKSIZE, length, 0) < 0;
+		else
+			failed = _scan_read(job, buffer, block, job->unit) < 0;
+		if (!failed) {
+			if (!job->writing)
+				_test_compare(job, buffer, block, job->unit);
+			continue;
+		}
+		for (bad = block; bad < block + job->unit; bad++)
+			_test_bad(job, bad);
+	}
+}
+
+static void *_scan_worker(void *arg)
+{
+	struct scanjob *job = arg;
+	struct vmubuffers *buffers = job->dev->buffers;
+	struct scanslot *slot;
+	unsigned int index;
+	char *buffer;
+	int failed;
+
+	pthread_mutex_lock(&job->lock);
+	index = job->slots++;
+	pthread_mutex_unlock(&job->lock);
+	slot = &job->slot[index];
+	buffer = buffers ? buffers->scan
+		+ (size_t)index * SCANEXTENT * VMU_BLOCKSIZE
+		: malloc(SCANEXTENT * VMU_BLOCKSIZE);
+	if (!buffer) {
+		pthread_mutex_lock(&job->lock);
+		job->error = -ENOMEM;
+		pthread_mutex_unlock(&job->lock);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&job->lock);
+	while (job->error == 0 && _scan_take(job, slot) == 0) {
+		pthread_mutex_unlock(&job->lock);
+
+		if (job->pattern) {
+			_test_extent(job, buffer, slot->start, slot->count);
+			pthread_mutex_lock(&job->lock);
+			_scan_done(job, slot);
+			continue;
+		}
+		failed = _scan_read(job, buffer, slot->start, slot->count);
+
+		pthread_mutex_lock(&job->lock);
+		_scan_adapt(job, slot, failed);
+		pthread_mutex_unlock(&job->lock);
+		if (failed)
+			_scan_bisect(job, buffer, slot->start, slot->count);
+
+		pthread_mutex_lock(&job->lock);
+		_scan_done(job, slot);
+	}
+	pthread_mutex_unlock(&job->lock);
+	if (!buffers)
+		free(buffer);
+	return NULL;
+}
+
+#ifdef HAVE_IO_URING
+/* Keep the ring full of extent reads; only failed extents are bisected */
+static int _ring_scan(struct vmudev *dev, struct scanjob *job)
+{
+	struct vmuring *ring = dev->ring;
+	struct io_uring_cqe cqe;
+	struct scanslot *slot;
+	unsigned int *freeslot;
+	unsigned int inflight = 0, slots, index;
+	char *buffers, *buffer;
+	int error = -ENOMEM, failed;
+
+	slots = _ring_slots(ring);
+	buffers = dev->buffers ? dev->buffers->scan
+		: malloc((size_t)slots * SCANEXTENT * VMU_BLOCKSIZE);
+	freeslot = calloc(slots, sizeof(unsigned int));
+	if (!buffers || !freeslot)
+		goto clean;
+	job->slots = slots;
+	for (index = 0; index < slots; index++)
+		freeslot[index] = index;
+
+	while (1) {
+		while (inflight < slots) {
+			index = freeslot[inflight];
+			slot = &job->slot[index];
+			if (_scan_take(job, slot) < 0)
+				break;
+			inflight++;
+			_ring_prep(ring, IORING_OP_READ, dev->fd,
+				buffers
+				+ (size_t)index * SCANEXTENT * VMU_BLOCKSIZE,
+				slot->count * VMU_BLOCKSIZE,
+				(off_t)slot->start * VMU_BLOCKSIZE, index);
+		}
+		if (!inflight)
+			break;
+		if ((error = _ring_wait(dev, &cqe)) < 0) {
+			_ring_drain(dev, inflight);
+			goto clean;
+		}
+		index = cqe.user_data;
+		slot = &job->slot[index];
+		buffer = buffers + (size_t)index * SCANEXTENT * VMU_BLOCKSIZE;
+		_count_op(dev, 0, NULL);
+		if (cqe.res > 0)
+			_count_io(dev, 0, cqe.res, 0);
+		failed = cqe.res != slot->count * VMU_BLOCKSIZE;
+		_scan_adapt(job, slot, failed);
+		if (failed)
+			_scan_bisect(job, buffer, slot->start, slot->count);
+		freeslot[--inflight] = index;
+		_scan_done(job, slot);
+	}
+	error = 0;
+clean:
+	free(freeslot);
+	if (!dev->buffers)
+		free(buffers);
+	return error;
+}
+#else
+static int _ring_scan(struct vmudev *dev, struct scanjob *job)
+{
+	return -ENOSYS;
+}
+#endif
+
+static int _run_scan(struct scanjob *job, unsigned int slots)
+{
+	int i, threads;
+	pthread_t worker[SCANTHREADS];
+
+	job->slot = malloc(slots * sizeof(struct scanslot));
+	if (!job->slot)
+		return -ENOMEM;
+	for (i = 0; i < slots; i++)
+		job->slot[i].start = UINT_MAX;
+
+	pthread_mutex_init(&job->lock, NULL);
+	if (!job->pattern && job->dev->ring) {
+		job->error = _ring_scan(job->dev, job);
+		goto done;
+	}
+	for (threads = 0; threads < SCANTHREADS; threads++)
+		if (pthread_create(&worker[threads], NULL, _scan_worker,
+			job) != 0)
+			break;
+	/* No threads to be had - scan from here instead */
+	if (!threads)
+		_scan_worker(job);
+	for (i = 0; i < threads; i++)
+		pthread_join(worker[i], NULL);
+done:
+	pthread_mutex_destroy(&job->lock);
+	free(job->slot);
+	return job->error;
+}
+
+/*
+ * Read the whole of the volume the set covers, noting each block that
+ * will not read back in the set. The io_uring scan runs in the calling
+ * thread; otherwise SCANTHREADS threads share the work.
+ */
+int scanforbad(struct vmudev *dev, struct vmubadblocks *set,
+	const struct vmuscan *scan)
+{
+	struct scanjob job = {
+		.dev = dev,
+		.set = set,
+		.next = scan ? scan->from : 0,
+		.extent = SCANEXTENT,
+		.healthy = 0,
+		.readsecs = 0,
+		.slots = 0,
+		.pattern = NULL,
+		.scan = scan,
+		.error = 0,
+		.unit = _io_unit(dev),
+	};
+
+	job.next -= job.next % job.unit;
+	return _run_scan(&job, dev->ring ? dev->ring->depth : SCANTHREADS);
+}
+
+/*
+ * Destroy the contents of the volume and note every block that does not
+ * keep what was written. For each of PATTERNS in turn the whole volume
+ * is written, flushed to the media, and then read back and checked, as
+ * badblocks -w does, so each block is read only after everything else
+ * has been written and the device's cache cannot answer for it. Every
+ * block carries its own number too, so media that alias blocks onto
+ * each other, as fake-capacity cards do, fail the test. SCANTHREADS threads share
+ * each pass, whatever the device's ring. The caller hears VMU_SCAN_PASS
+ * before each pass, and progress within it.
+ */
+int vmufat_writetest(struct vmudev *dev, struct vmubadblocks *set,
+	const struct vmuscan *scan)
+{
+	char *patterns;
+	unsigned int i, pass, from = scan ? scan->from : 0;
+	off_t start;
+	int error = 0;
+	struct scanjob job = {
+		.dev = dev,
+		.set = set,
+		.extent = SCANEXTENT,
+		.scan = scan,
+		.error = 0,
+		.unit = _io_unit(dev),
+	};
+
+	from -= from % job.unit;
+	start = (off_t)from * VMU_BLOCKSIZE;
+	patterns = dev->buffers ? dev->buffers->patterns
+		: malloc(NPATTERNS * SCANEXTENT * VMU_BLOCKSIZE);
+	if (!patterns)
+		return -ENOMEM;
+	for (i = 0; i < NPATTERNS; i++)
+		memset(patterns + i * SCANEXTENT * VMU_BLOCKSIZE, PATTERNS[i],
+			SCANEXTENT * VMU_BLOCKSIZE);
+
+	for (pass = 0; pass < 2 * NPATTERNS; pass++) {
+		job.pattern = patterns + pass / 2 * SCANEXTENT * VMU_BLOCKSIZE;
+		job.writing = !(pass % 2);
+		job.next = from;
+		job.slots = 0;
+		_scan_notify(&job, VMU_SCAN_PASS, pass, 2 * NPATTERNS);
+		if ((error = _run_scan(&job, SCANTHREADS)) < 0)
+			break;
+		if (job.writing && (error = _flush_pass(dev, start,
+			(off_t)set->blocks * VMU_BLOCKSIZE - start)) < 0)
+			break;
+	}
+	if (!dev->buffers)
+		free(patterns);
+	return error;
+}
+
+/* Write the image from block from upwards */
+int vmufat_write_system_image(struct vmudev *dev, const struct vmuimage *image,
+	unsigned int from)
+{
+	size_t length = (image->firstblock + image->blocks - from)
+		* VMU_BLOCKSIZE;
+
+	return _write_extent(dev, vmufat_image_block(image, from),
+		ZEROEXTENT * VMU_BLOCKSIZE, (off_t)from * VMU_BLOCKSIZE, length,
+		0);
+}
+
+/*
+ * First block of the physical sector holding the root block, or of the
+ * image if the whole volume is smaller than a sector
+ */
+static unsigned int _root_sector(const struct vmudev *dev,
+	const struct vmuimage *image)
+{
+	unsigned int unit = dev->physical / VMU_BLOCKSIZE;
+
+	if (image->blocks <= unit)
+		return image->firstblock;
+	return image->firstblock + image->blocks - unit;
+}
+
+/*
+ * As vmufat_write_system_image(), but flush the directory and FAT to the media
+ * before writing the sector with the root block, so a crash can never
+ * leave a root block in front of metadata that is not there yet.
+ */
+int vmufat_write_system_image_ordered(struct vmudev *dev,
+	const struct vmuimage *image, unsigned int from)
+{
+	unsigned int root = _root_sector(dev, image);
+	int error;
+
+	if (from >= root)
+		return vmufat_write_system_image(dev, image, from);
+	if ((error = _write_extent(dev, vmufat_image_block(image, from),
+		ZEROEXTENT * VMU_BLOCKSIZE, (off_t)from * VMU_BLOCKSIZE,
+		(size_t)(root - from) * VMU_BLOCKSIZE, 0)) < 0
+		|| (error = vmufat_sync_device(dev)) < 0)
+		return error;
+	return vmufat_write_system_image(dev, image, root);
+}
+
+static int _write_stream(struct vmudev *dev, const char *buffer,
+	size_t buflen, off_t length, int repeat)
+{
+	ssize_t written;
+	size_t chunk;
+	struct timespec began;
+
+	while (length > 0) {
+		chunk = length < buflen ? length : buflen;
+		clock_gettime(CLOCK_MONOTONIC, &began);
+		written = write(dev->fd, buffer, chunk);
+		_count_op(dev, 1, &began);
+		_count_io(dev, 1, 0, written > 0 ? written : 0);
+		if (written <= 0)
+			return written < 0 ? -errno : -EIO;
+		if (!repeat)
+			buffer += written;
+		length -= written;
+	}
+	return 0;
+}
+
+/*
+ * For a descriptor that cannot seek: the user area from a shared zero
+ * buffer, then the system image, strictly in order.
+ */
+int vmufat_stream_volume(struct vmudev *dev, const struct vmuimage *image)
+{
+	char *zilches;
+	int error;
+
+	zilches = dev->buffers ? dev->buffers->zeroes
+		: calloc(ZEROEXTENT, VMU_BLOCKSIZE);
+	if (!zilches)
+		return -ENOMEM;
+	error = _write_stream(dev, zilches, ZEROEXTENT * VMU_BLOCKSIZE,
+		(off_t)image->firstblock * VMU_BLOCKSIZE, 1);
+	if (!error)
+		error = _write_stream(dev, image->buffer,
+			image->blocks * VMU_BLOCKSIZE,
+			(off_t)image->blocks * VMU_BLOCKSIZE, 0);
+	if (!dev->buffers)
+		free(zilches);
+	return error;
+}
+
+/* Offset of the first octet where a and b differ, or length if none */
+static size_t _first_mismatch(const char *a, const char *b, size_t length)
+{
+	size_t done, chunk;
+
+	for (done = 0; done < length; done += chunk) {
+		chunk = length - done;
+		if (chunk > VERIFYEXTENT * VMU_BLOCKSIZE)
+			chunk = VERIFYEXTENT * VMU_BLOCKSIZE;
+		if (memcmp(a + done, b + done, chunk) == 0)
+			continue;
+		while (a[done] == b[done])
+			done++;
+		return done;
+	}
+	return length;
+}
+
+/* Offset of the first non-zero octet, or length if none */
+static size_t _first_nonzero(const char *buf, size_t length)
+{
+	const uint64_t *word = (const uint64_t *)buf;
+	size_t i;
+
+	/* buf comes from mmap or malloc, so it is word aligned */
+	for (i = 0; i < length / 8; i++)
+		if (word[i])
+			break;
+	for (i *= 8; i < length; i++)
+		if (buf[i])
+			break;
+	return i;
+}
+
+/* Write count blocks from block, out of want or the shared zeroes */
+static int _write_run(struct vmudev *dev, const char *want,
+	const char *zeroes, unsigned int start, unsigned int block,
+	unsigned int count, unsigned int *written)
+{
+	int error;
+
+	if (want)
+		error = _write_extent(dev,
+			want + (block - start) * VMU_BLOCKSIZE,
+			count * VMU_BLOCKSIZE, (off_t)block * VMU_BLOCKSIZE,
+			count * VMU_BLOCKSIZE, 0);
+	else
+		error = _write_extent(dev, zeroes, ZEROEXTENT * VMU_BLOCKSIZE,
+			(off_t)block * VMU_BLOCKSIZE, count * VMU_BLOCKSIZE, 1);
+	if (error < 0)
+		return error;
+	*written += count;
+	return 0;
+}
+
+/*
+ * Bring count blocks from start into line with want, or with zeroes
+ * when want is NULL, reading them back an extent at a time and writing
+ * only the runs of unit-block sectors that differ; a short tail is
+ * compared as it is. *written is raised by the blocks that took.
+ */
+static int _write_changed(struct vmudev *dev, const char *want,
+	const char *zeroes, char *buffer, unsigned int start,
+	unsigned int count, unsigned int unit, unsigned int *written)
+{
+	unsigned int at, chunk, i, step, run;
+	size_t length;
+	const char *got;
+	struct timespec began;
+	ssize_t done;
+	int error, differs;
+
+	for (at = start; at < start + count; at += chunk) {
+		chunk = start + count - at;
+		if (chunk > SCANEXTENT)
+			chunk = SCANEXTENT;
+		clock_gettime(CLOCK_MONOTONIC, &began);
+		done = pread(dev->fd, buffer, chunk * VMU_BLOCKSIZE,
+			(off_t)at * VMU_BLOCKSIZE);
+		_count_op(dev, 0, &began);
+		_count_io(dev, 1, done > 0 ? done : 0, 0);
+		if (done != chunk * VMU_BLOCKSIZE)
+			return done < 0 ? -errno : -EIO;
+
+		for (i = 0, run = 0; i < chunk; i += step) {
+			step = chunk - i < unit ? chunk - i : unit;
+			length = step * VMU_BLOCKSIZE;
+			got = buffer + i * VMU_BLOCKSIZE;
+			if (want)
+				differs = memcmp(got, want + (at - start + i)
+					* VMU_BLOCKSIZE, length) != 0;
+			else
+				differs = _first_nonzero(got, length) < length;
+			/* Extend the run while sectors differ */
+			if (differs) {
+				run += step;
+				continue;
+			}
+			if (run && (error = _write_run(dev, want, zeroes, start,
+				at + i - run, run, written)) < 0)
+				return error;
+			run = 0;
+		}
+		if (run && (error = _write_run(dev, want, zeroes, start,
+			at + chunk - run, run, written)) < 0)
+			return error;
+	}
+	return 0;
+}
+
+/*
+ * Reformat a volume in place by writing only what differs: the system
+ * image blocks that do not already match, and with zero set the user
+ * blocks that are not already zero. Everything is read back first, so
+ * a card that is nearly right costs a read and a few writes rather
+ * than a full sweep. *written is how many blocks were written. With
+ * ordered set, what was written is flushed before moving on to the
+ * system image and again before the sector with the root block.
+ */
+int vmufat_rewrite_volume(struct vmudev *dev, const struct vmuimage *image,
+	int zero, int ordered, unsigned int *written)
+{
+	unsigned int unit = dev->physical / VMU_BLOCKSIZE;
+	unsigned int root = _root_sector(dev, image), flushed;
+	char *buffer, *zeroes;
+	int error = -ENOMEM;
+
+	*written = 0;
+	if (dev->buffers) {
+		buffer = dev->buffers->scan;
+		zeroes = dev->buffers->zeroes;
+	}
+	else {
+		buffer = malloc(SCANEXTENT * VMU_BLOCKSIZE);
+		zeroes = calloc(ZEROEXTENT, VMU_BLOCKSIZE);
+		if (!buffer || !zeroes)
+			goto clean;
+	}
+
+	/* User blocks first, so the root block is still the last written */
+	if (zero && (error = _write_changed(dev, NULL, zeroes, buffer, 0,
+		image->firstblock, unit, written)) < 0)
+		goto clean;
+	if (ordered && *written && (error = vmufat_sync_device(dev)) < 0)
+		goto clean;
+	flushed = *written;
+	error = _write_changed(dev, image->buffer, zeroes, buffer,
+		image->firstblock, root - image->firstblock, unit, written);
+	if (error < 0 || (ordered && *written > flushed
+		&& (error = vmufat_sync_device(dev)) < 0))
+		goto clean;
+	error = _write_changed(dev, vmufat_image_block(image, root), zeroes,
+		buffer, root, image->firstblock + image->blocks - root, unit,
+		written);
+clean:
+	if (!dev->buffers) {
+		free(zeroes);
+		free(buffer);
+	}
+	return error;
+}
+
+/*
+ * Read back from octet start to end with O_DIRECT, a scan extent at a
+ * time, and compare it with the image - or with zeroes below it
+ */
+static int _verify_direct(struct vmudev *dev, const struct vmuimage *image,
+	off_t start, off_t end, off_t *mismatch)
+{
+	off_t system = (off_t)image->firstblock * VMU_BLOCKSIZE;
+	char *buffer = dev->buffers->scan;
+	struct timespec began;
+	size_t chunk, at;
+	ssize_t got;
+
+	for (; start < end; start += chunk) {
+		chunk = end - start;
+		if (chunk > SCANEXTENT * VMU_BLOCKSIZE)
+			chunk = SCANEXTENT * VMU_BLOCKSIZE;
+		/* Never straddle the bottom of the system image */
+		if (start < system && start + chunk > system)
+			chunk = system - start;
+		clock_gettime(CLOCK_MONOTONIC, &began);
+		got = pread(dev->fd, buffer, chunk, start);
+		_count_op(dev, 0, &began);
+		_count_io(dev, 1, got > 0 ? got : 0, 0);
+		if (got != chunk)
+			return got < 0 ? -errno : -EIO;
+		if (start < system)
+			at = _first_nonzero(buffer, chunk);
+		else
+			at = _first_mismatch(buffer, image->buffer
+				+ (start - system), chunk);
+		if (at < chunk) {
+			*mismatch = start + at;
+			return -EILSEQ;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Map what was written and compare it with the image in memory. For an
+ * image file whose user area was zeroed that is checked for zeroes too.
+ * A block device is read back through the page cache, so this checks
+ * what the kernel will write rather than what the media holds - unless
+ * it is open O_DIRECT, when what comes back is from the media. Fails
+ * with -EILSEQ, and the octet offset in mismatch, if they differ.
+ */
+int vmufat_verify_volume(struct vmudev *dev, const struct vmuimage *image,
+	int zeroed, off_t *mismatch)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	off_t start, end, mapstart;
+	size_t maplength, at;
+	char *map;
+	int error = -EILSEQ;
+
+	start = dev->isblk || !zeroed
+		? (off_t)image->firstblock * VMU_BLOCKSIZE : 0;
+	end = (off_t)(image->firstblock + image->blocks) * VMU_BLOCKSIZE;
+	if (dev->direct)
+		return dev->buffers ? _verify_direct(dev, image, start, end,
+			mismatch) : -EINVAL;
+	mapstart = start - start % pagesize;
+	maplength = end - mapstart;
+
+	map = mmap(NULL, maplength, PROT_READ, MAP_SHARED, dev->fd, mapstart);
+	_count_io(dev, 2, maplength, 0);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	at = _first_nonzero(map + (start - mapstart),
+		(off_t)image->firstblock * VMU_BLOCKSIZE - start);
+	if (at < (off_t)image->firstblock * VMU_BLOCKSIZE - start) {
+		*mismatch = start + at;
+		goto unmap;
+	}
+	at = _first_mismatch(map + maplength - image->blocks * VMU_BLOCKSIZE,
+		image->buffer, image->blocks * VMU_BLOCKSIZE);
+	if (at < image->blocks * VMU_BLOCKSIZE) {
+		*mismatch = (off_t)image->firstblock * VMU_BLOCKSIZE + at;
+		goto unmap;
+	}
+	error = 0;
+unmap:
+	munmap(map, maplength);
+	return error;
+}
@@ -0,0 +1,208 @@
+/*
+ * libvmufat.h - lay out and write VMUFAT volumes
+ *
+ * Copyright (c) 2012 Adrian McMenamin adrianmcmenamin@gmail.com
+ * Licensed under Version 2 of the GNU General Public Licence
+ *
+ * Nothing here prints or keeps state of its own, so one process can
+ * format any number of devices at once, each with its own struct
+ * vmudev. Functions returning int give 0 on success and a negative
+ * errno value on failure. Names are prefixed vmufat_ (VMU_ for
+ * constants), apart from the calls mkfs.vmufat has always made. Build it
+ * in alongside mkfs.vmufat.c:
+ *
+ *	cc -o mkfs.vmufat mkfs.vmufat.c libvmufat.c -lpthread
+ */
+
+#ifndef LIBVMUFAT_H
+#define LIBVMUFAT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define VMU_BLOCKSIZE 512
+#define VMU_BLOCKSHIFT 9
+/* The root block and FAT hold 16-bit block numbers */
+#define VMU_MAXBLOCKS 65536
+/* FAT entries that are not the next block of a file */
+#define VMU_FAT_FREE 0xFFFC
+#define VMU_FAT_END 0xFFFA
+/* Latency histogram buckets, powers of two from 1us */
+#define VMU_LATBUCKETS 24
+
+struct vmuparam {
+	unsigned int size;
+	unsigned int rootblock;
+	unsigned int fatstart;
+	unsigned int fatsize;
+	unsigned int dirstart;
+	unsigned int dirsize;
+};
+
+/* In-memory copy of the directory, FAT and root block */
+struct vmuimage {
+	/* Supplied by the caller, see vmufat_init_system_image() */
+	char *buffer;
+	unsigned int firstblock;
+	unsigned int blocks;
+};
+
+/* Our view of an io_uring instance, set up without liburing */
+struct vmuring {
+	int fd;
+	unsigned int depth;
+	unsigned int queued;
+	unsigned int *sqhead, *sqtail, *sqmask, *sqarray;
+	unsigned int *cqhead, *cqtail, *cqmask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sqring, *cqring;
+	size_t sqlen, cqlen, sqeslen;
+};
+
+/* Running I/O totals for a device */
+struct vmucount {
+	unsigned long syscalls;
+	unsigned long reads;
+	unsigned long writes;
+	unsigned long long bytesread;
+	unsigned long long byteswritten;
+	unsigned long fsyncs;
+	unsigned long long fsyncnsec;
+	/* latency[i] counts requests taking under 2^(i+1) microseconds */
+	unsigned long latency[VMU_LATBUCKETS];
+};
+
+/*
+ * Page-aligned buffers for a device's zeroing, scans and verify, mapped
+ * once by vmufat_open_buffers() rather than allocated by each call
+ */
+struct vmubuffers {
+	void *base;
+	size_t length;
+	char *zeroes;
+	char *patterns;
+	/* One scan extent for each scan thread or ring slot */
+	char *scan;
+	unsigned int scanslots;
+};
+
+/* The open device and the engine used to drive its I/O */
+struct vmudev {
+	int fd;
+	int isblk;
+	off_t size;
+	/* Sector sizes in octets; writes are aligned to the physical size */
+	unsigned int logical;
+	unsigned int physical;
+	/*
+	 * Opened O_DIRECT, so I/O must be aligned to the logical size; set
+	 * before vmufat_probe_device(), and open buffers with
+	 * vmufat_open_buffers()
+	 */
+	int direct;
+	/* NULL for plain synchronous pread/pwrite */
+	struct vmuring *ring;
+	/* NULL to allocate buffers as each call needs them */
+	struct vmubuffers *buffers;
+	struct vmucount count;
+};
+
+/* One bit per block of the volume */
+struct vmubadblocks {
+	unsigned long *map;
+	unsigned int blocks;
+	unsigned int count;
+};
+
+/*
+ * What a surface scan or write test tells its caller about, see
+ * struct vmuscan
+ */
+enum {
+	/* About to test count blocks from start */
+	VMU_SCAN_READ,
+	/* Block start gives a bad read or did not keep a pattern */
+	VMU_SCAN_BAD,
+	/* Every block below start is scanned; start is blocks when done */
+	VMU_SCAN_PROGRESS,
+	/* A write test pass starts: pass start of count, from scan->from */
+	VMU_SCAN_PASS,
+};
+
+/*
+ * How a surface scan starts and reports back. notify may be NULL. It is
+ * called with the scan serialised, from whichever thread did the work,
+ * so it may read the bad block set but must not block for long.
+ */
+struct vmuscan {
+	/* First block to read, to resume an interrupted scan */
+	unsigned int from;
+	void (*notify)(void *arg, int event, unsigned int start,
+		unsigned int count);
+	void *arg;
+};
+
+int vmufat_init_badblocks(struct vmubadblocks *set, unsigned int blocks);
+void vmufat_clean_badblocks(struct vmubadblocks *set);
+int vmufat_add_badblock(struct vmubadblocks *set, unsigned long block);
+unsigned int vmufat_add_badblocks(struct vmubadblocks *set, unsigned long first,
+	unsigned long last);
+unsigned int vmufat_next_badblock(const struct vmubadblocks *set,
+	unsigned int from);
+
+double vmufat_elapsed_seconds(const struct timespec *since);
+int vmufat_sync_device(struct vmudev *dev);
+
+int vmufat_probe_device(struct vmudev *dev);
+int calculate_vmuparams(const struct vmudev *dev, struct vmuparam *param,
+	int blocknum);
+
+unsigned int vmufat_system_image_blocks(const struct vmuparam *param,
+	unsigned int lowest, unsigned int align);
+void vmufat_init_system_image(struct vmuimage *image,
+	const struct vmuparam *param, unsigned int lowest, unsigned int align,
+	char *buffer);
+char *vmufat_image_block(const struct vmuimage *image, unsigned int block);
+void vmufat_copy_system_image(struct vmuimage *image,
+	const struct vmuimage *golden);
+void fill_root_block(char *buf, const struct vmuparam *param);
+int mark_root_block(struct vmuimage *image, const struct vmuparam *param);
+int vmufat_stamp_root_block(struct vmuimage *image,
+	const struct vmuparam *param);
+int mark_fat(struct vmuimage *image, const struct vmuparam *param);
+int vmufat_standard_system_image(struct vmuimage *image,
+	const struct vmuparam *param);
+int mark_bad_blocks(struct vmuimage *image, const struct vmubadblocks *set,
+	const struct vmuparam *param);
+unsigned int vmufat_data_base(const struct vmuparam *param,
+	const struct vmubadblocks *set, unsigned int blocks);
+unsigned int vmufat_fat_next(const struct vmuimage *image,
+	const struct vmuparam *param, unsigned int block);
+int vmufat_add_file(struct vmuimage *image, const struct vmuparam *param,
+	const char *name, size_t length, time_t mtime, unsigned int *cursor,
+	unsigned int *start);
+
+int vmufat_open_ring(struct vmuring *ring, unsigned int depth);
+void vmufat_close_ring(struct vmuring *ring);
+int vmufat_open_buffers(struct vmubuffers *buffers, const struct vmudev *dev);
+void vmufat_close_buffers(struct vmubuffers *buffers);
+
+int scanforbad(struct vmudev *dev, struct vmubadblocks *set,
+	const struct vmuscan *scan);
+int vmufat_writetest(struct vmudev *dev, struct vmubadblocks *set,
+	const struct vmuscan *scan);
+int vmufat_discard_blocks(struct vmudev *dev, const struct vmuimage *image);
+int zero_blocks(struct vmudev *dev, const struct vmuimage *image);
+int vmufat_write_system_image(struct vmudev *dev, const struct vmuimage *image,
+	unsigned int from);
+int vmufat_write_system_image_ordered(struct vmudev *dev,
+	const struct vmuimage *image, unsigned int from);
+int vmufat_stream_volume(struct vmudev *dev, const struct vmuimage *image);
+int vmufat_rewrite_volume(struct vmudev *dev, const struct vmuimage *image,
+	int zero, int ordered, unsigned int *written);
+int vmufat_verify_volume(struct vmudev *dev, const struct vmuimage *image,
+	int zeroed, off_t *mismatch);
+
+#endif
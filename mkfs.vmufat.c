@@ -8,499 +8,1800 @@
  * copyright Linus Torvalds and others
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
-#include <asm/byteorder.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <mntent.h>
 #include <paths.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <time.h>
 #include <unistd.h>
 
-static const int BLOCKSIZE = 512;
-static const int BLOCKSHIFT = 9;
+#include "libvmufat.h"
 
-struct vmuparam {
-	unsigned int size;
-	unsigned int rootblock;
-	unsigned int fatstart;
-	unsigned int fatsize;
-	unsigned int dirstart;
-	unsigned int dirsize;
+/* Seconds between scan journal checkpoints */
+static const int CHECKPOINTSECS = 10;
+/* Seconds between -v scan progress updates, on a terminal and in a log */
+static const double STATUSSECS = 0.5;
+static const double LOGSTATUSSECS = 10;
+#define MAXPHASES 16
+
+/* What one phase of the format cost */
+struct vmuphase {
+	const char *name;
+	double seconds;
+	struct vmucount count;
+};
+
+/* Per-phase timings and I/O totals for -b and -s */
+struct vmubench {
+	struct timespec start;
+	struct vmucount count;
+	int phases;
+	struct vmuphase phase[MAXPHASES];
+};
+
+/* -F: what is flushed to the media, and when */
+enum {
+	/* No -F: as DURABLE_NONE, or DURABLE_SYNC with -s */
+	DURABLE_DEFAULT,
+	/* Left to the device's cache */
+	DURABLE_NONE,
+	/* One fdatasync once everything is written */
+	DURABLE_SYNC,
+	/* Flushed after zeroing and before the root block, then at the end */
+	DURABLE_ORDERED,
+};
+
+/* Options that apply to every target */
+struct vmuopts {
+	int blocknum;
+	int verbose, scanbadblocks, useblocklist, allowfile;
+	int sparse, depth, benchmark, verify;
+	int quick, discard, destructive, direct, rewrite, durability;
+	const char *blocklistfnm;
+	const char *statsname;
+	const char *cachedir;
+	const char *journal;
+	const char *sourcedir;
+};
+
+/* A regular file from the -d directory */
+struct srcfile {
+	char name[13];
+	off_t size;
+	time_t mtime;
+};
+
+/* One device or image to format, and how that went */
+struct vmutarget {
+	char *device_name;
+	/* From the manifest, overriding -N, -B and -d when set */
+	int blocknum;
+	char *sourcedir;
+	int error;
+	double seconds;
+	struct vmubench bench;
+};
+
+/* The golden image for one geometry, shared by all targets of that size */
+struct goldenimage {
+	struct vmuparam param;
+	struct vmuimage image;
+	struct goldenimage *next;
+};
+
+/* Work shared by the -j formatting threads */
+struct batchjob {
+	const struct vmuopts *opts;
+	struct vmutarget *target;
+	int targets;
+	int next;
+	struct goldenimage *golden;
+	const struct mountindex *mounts;
+	pthread_mutex_t lock;
 };
 
-struct badblocklist {
-	int number;
-	struct badblocklist *next;
+/* How far the surface scan has got, for the messages and -J journal */
+struct scanreport {
+	const struct vmubadblocks *set;
+	const char *device_name;
+	/* NULL unless -J was given */
+	const char *journal;
+	time_t lastcheck;
+	/* Set for the -w write test */
+	int destructive;
+	int verbose;
+	/* Redraw one status line rather than logging a line per update */
+	int live;
+	/* A live status line is showing and wants ending before a message */
+	int showing;
+	unsigned int from;
+	/* The write test's pass under way, out of passes */
+	unsigned int pass, passes;
+	struct timespec began, lastshown;
+	/*
+	 * Checkpoints are copied into pending under lock, and written out
+	 * from written by the journal thread, away from the scan's lock
+	 */
+	int writing;
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	struct vmubadblocks pending, written;
+	unsigned int scanned;
+	int due, stop;
 };
 
-static struct badblocklist* _add_badblock(struct badblocklist *root, int block)
+static void _count_since(struct vmucount *delta, const struct vmucount *now,
+	const struct vmucount *then)
 {
-	struct badblocklist *nextone;
+	int i;
 
-	nextone = malloc(sizeof(struct badblocklist));
-	if (!nextone)
-		return NULL;
-	nextone->next = NULL;
-	nextone->number = block;
+	delta->syscalls = now->syscalls - then->syscalls;
+	delta->reads = now->reads - then->reads;
+	delta->writes = now->writes - then->writes;
+	delta->bytesread = now->bytesread - then->bytesread;
+	delta->byteswritten = now->byteswritten - then->byteswritten;
+	delta->fsyncs = now->fsyncs - then->fsyncs;
+	delta->fsyncnsec = now->fsyncnsec - then->fsyncnsec;
+	for (i = 0; i < VMU_LATBUCKETS; i++)
+		delta->latency[i] = now->latency[i] - then->latency[i];
+}
 
-	if (root)
-		root->next = nextone;
-	return nextone;
+/* bench is NULL unless -b or -s was given; dev is NULL for in-memory phases */
+static void bench_begin(struct vmubench *bench, const struct vmudev *dev)
+{
+	if (!bench)
+		return;
+	if (dev)
+		bench->count = dev->count;
+	else
+		memset(&bench->count, 0, sizeof(bench->count));
+	clock_gettime(CLOCK_MONOTONIC, &bench->start);
 }
 
-static void clean_blocklist(struct badblocklist *nextblock)
+static void bench_end(struct vmubench *bench, const struct vmudev *dev,
+	const char *name)
 {
-	if (!nextblock)
+	struct vmuphase *phase;
+
+	if (!bench || bench->phases >= MAXPHASES)
 		return;
-	clean_blocklist(nextblock->next);
-	free(nextblock);
+	phase = &bench->phase[bench->phases++];
+	phase->name = name;
+	phase->seconds = vmufat_elapsed_seconds(&bench->start);
+	memset(&phase->count, 0, sizeof(phase->count));
+	if (dev)
+		_count_since(&phase->count, &dev->count, &bench->count);
+}
+
+static void bench_report(const struct vmubench *bench)
+{
+	int i;
+	double mbytes;
+	const struct vmuphase *phase;
+
+	printf("%-20s %12s %10s %14s %14s %10s\n", "phase", "seconds",
+		"syscalls", "read", "written", "MiB/s");
+	for (i = 0; i < bench->phases; i++) {
+		phase = &bench->phase[i];
+		mbytes = (phase->count.bytesread + phase->count.byteswritten)
+			/ 1048576.0;
+		printf("%-20s %12.6f %10lu %14llu %14llu %10.1f\n",
+			phase->name, phase->seconds, phase->count.syscalls,
+			phase->count.bytesread, phase->count.byteswritten,
+			phase->seconds > 0 ? mbytes / phase->seconds : 0.0);
+	}
+}
+
+static void _json_string(FILE *out, const char *string)
+{
+	fputc('"', out);
+	for (; *string; string++) {
+		if (*string == '"' || *string == '\\')
+			fputc('\\', out);
+		if ((unsigned char)*string < 0x20)
+			fprintf(out, "\\u%04x", *string);
+		else
+			fputc(*string, out);
+	}
+	fputc('"', out);
+}
+
+static void _json_target(FILE *out, const struct vmutarget *target)
+{
+	const struct vmubench *bench = &target->bench;
+	const struct vmuphase *phase;
+	int i, j, first;
+
+	fprintf(out, "{\"device\": ");
+	_json_string(out, target->device_name);
+	fprintf(out, ", \"ok\": %s, \"phases\": [",
+		target->error ? "false" : "true");
+	for (i = 0; i < bench->phases; i++) {
+		phase = &bench->phase[i];
+		fprintf(out, "%s\n  {\"name\": \"%s\", \"seconds\": %.9f, "
+			"\"syscalls\": %lu, \"reads\": %lu, \"writes\": %lu, "
+			"\"bytes_read\": %llu, \"bytes_written\": %llu, "
+			"\"fsyncs\": %lu, \"fsync_seconds\": %.9f, "
+			"\"latency_us\": [", i ? "," : "", phase->name,
+			phase->seconds, phase->count.syscalls,
+			phase->count.reads, phase->count.writes,
+			phase->count.bytesread, phase->count.byteswritten,
+			phase->count.fsyncs, phase->count.fsyncnsec / 1e9);
+		/* [upper bound in microseconds, requests] for each used bucket */
+		for (j = 0, first = 1; j < VMU_LATBUCKETS; j++) {
+			if (!phase->count.latency[j])
+				continue;
+			fprintf(out, "%s[%lu, %lu]", first ? "" : ", ",
+				2UL << j, phase->count.latency[j]);
+			first = 0;
+		}
+		fprintf(out, "]}");
+	}
+	fprintf(out, "\n]}");
+}
+
+/*
+ * The -s report: the same phases as -b, as JSON. A batch gets an array
+ * of the objects a single target would.
+ */
+static int write_stats(const char *statsname, const struct vmutarget *target,
+	int targets, int batch)
+{
+	FILE *statsfile;
+	int i;
+
+	if (strcmp(statsname, "-") == 0)
+		statsfile = stderr;
+	else if (!(statsfile = fopen(statsname, "w"))) {
+		printf("Could not open %s\n", statsname);
+		return -1;
+	}
+
+	if (batch)
+		fprintf(statsfile, "[");
+	for (i = 0; i < targets; i++) {
+		if (batch)
+			fprintf(statsfile, "%s\n", i ? "," : "");
+		_json_target(statsfile, &target[i]);
+	}
+	fprintf(statsfile, batch ? "\n]\n" : "\n");
+
+	if (statsfile != stderr)
+		fclose(statsfile);
+	return 0;
 }
-	
 
 static void usage(void)
 {
 	printf("Create a VMUFAT filesystem.\n");
-	printf("Usage: mkfs.vmufat [-c|-l filename] [-N number-of-blocks]\n");
-	printf("\t[-B log2-number-of-blocks] [-v] [-f]");
-	printf(" device [number-of-blocks]\n");
+	printf("Usage: mkfs.vmufat [-c|-w [-J journal]|-l filename]");
+	printf(" [-N number-of-blocks]\n");
+	printf("\t[-B log2-number-of-blocks] [-v] [-f] [-S] [-q|-D]");
+	printf(" [-u queue-depth]\n");
+	printf("\t[-b] [-s stats-file] [-G cache-directory] [-V]");
+	printf(" [-d directory] [-x] [-r]\n");
+	printf("\t[-F none|sync|ordered (-s implies sync)] ");
+	printf("device|- [number-of-blocks]\n");
+	printf("       mkfs.vmufat -j jobs|-m manifest [options] device...\n");
+	printf("\twith manifest lines of device [number-of-blocks|-"
+		" [directory]]\n");
+}
+
+/* Open-addressed sets of what is mounted, built once for the whole run */
+struct mountindex {
+	/* Device numbers of mounted sources; 0 marks a free slot */
+	dev_t *dev;
+	unsigned int devmask;
+	/* Source names, for targets that are not block devices */
+	char **name;
+	unsigned int namemask;
+};
+
+static unsigned int _hash_dev(dev_t dev)
+{
+	uint64_t hash = (uint64_t)dev * 0x9E3779B97F4A7C15ULL;
+
+	return hash >> 32;
+}
+
+static unsigned int _hash_name(const char *name)
+{
+	unsigned int hash = 2166136261U;
+
+	while (*name)
+		hash = (hash ^ (unsigned char)*name++) * 16777619U;
+	return hash;
+}
+
+/* mountinfo escapes space, tab, newline and backslash as \ooo */
+static void _unescape(char *field)
+{
+	char *out = field;
+
+	for (; *field; field++, out++) {
+		if (field[0] == '\\' && field[1] >= '0' && field[1] <= '3'
+			&& field[2] >= '0' && field[2] <= '7'
+			&& field[3] >= '0' && field[3] <= '7') {
+			*out = (field[1] - '0') << 6 | (field[2] - '0') << 3
+				| (field[3] - '0');
+			field += 3;
+		}
+		else
+			*out = *field;
+	}
+	*out = '\0';
+}
+
+/*
+ * Note one mounted source: its device number as mountinfo gives it, and
+ * as the source path itself resolves, in case they differ (btrfs, or a
+ * device reached through a symlink), and its name.
+ */
+static void _index_mount(struct mountindex *index, dev_t dev,
+	const char *source)
+{
+	struct stat sourcestat;
+	unsigned int slot;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (i == 1) {
+			if (source[0] != '/' || stat(source, &sourcestat) < 0
+				|| !S_ISBLK(sourcestat.st_mode))
+				break;
+			dev = sourcestat.st_rdev;
+		}
+		if (!dev)
+			continue;
+		for (slot = _hash_dev(dev) & index->devmask;
+			index->dev[slot] && index->dev[slot] != dev;
+			slot = (slot + 1) & index->devmask)
+			;
+		index->dev[slot] = dev;
+	}
+
+	for (slot = _hash_name(source) & index->namemask;
+		index->name[slot]; slot = (slot + 1) & index->namemask)
+		if (strcmp(index->name[slot], source) == 0)
+			return;
+	index->name[slot] = strdup(source);
 }
 
-static int checkmount(const char *device_name)
+static void clean_mountindex(struct mountindex *index)
+{
+	unsigned int i;
+
+	if (index->name)
+		for (i = 0; i <= index->namemask; i++)
+			free(index->name[i]);
+	free(index->name);
+	free(index->dev);
+	index->name = NULL;
+	index->dev = NULL;
+}
+
+/*
+ * Read /proc/self/mountinfo, or the mount table where that is missing,
+ * into index. Each mount can add two device numbers and one name, and
+ * the tables are kept at most a quarter full.
+ */
+static int build_mountindex(struct mountindex *index)
 {
 	FILE *f;
-	struct mntent *mnt;
+	char line[PATH_MAX * 4];
+	char *separator, *source;
+	unsigned int major, minor, size;
+	int skip;
+	int mounts = 0, info = 1;
+	struct mntent *mnt, entry;
 
-	if ((f = setmntent(_PATH_MOUNTED, "r")) == NULL)
-		return;
-	while ((mnt = getmntent(f)) != NULL)
-		if (strcmp(device_name, mnt->mnt_fsname) == 0)
-			break;
-	endmntent(f);
-	if (!mnt)
+	if (!(f = fopen("/proc/self/mountinfo", "r"))) {
+		info = 0;
+		if (!(f = setmntent(_PATH_MOUNTED, "r")))
+			return -1;
+	}
+	while (fgets(line, sizeof(line), f))
+		mounts++;
+	rewind(f);
+
+	for (size = 16; size < mounts * 8; size *= 2)
+		;
+	index->devmask = size - 1;
+	index->namemask = size / 2 - 1;
+	index->dev = calloc(size, sizeof(dev_t));
+	index->name = calloc(size / 2, sizeof(char *));
+	if (!index->dev || !index->name)
+		goto fail;
+
+	while (info && fgets(line, sizeof(line), f)) {
+		/* Cut short by fgets - the rest of it is not a new mount */
+		if (!strchr(line, '\n') && !feof(f)) {
+			while (fgets(line, sizeof(line), f)
+				&& !strchr(line, '\n'))
+				;
+			continue;
+		}
+		/* id parent major:minor root point options [tags] - type source */
+		separator = strstr(line, " - ");
+		if (!separator || sscanf(line, "%*u %*u %u:%u", &major,
+			&minor) != 2)
+			continue;
+		skip = 0;
+		sscanf(separator, " - %*s %n", &skip);
+		/* The source is taken in place, however long it is */
+		source = separator + skip;
+		source[strcspn(source, " \n")] = '\0';
+		if (!skip || !*source)
+			continue;
+		_unescape(source);
+		_index_mount(index, makedev(major, minor), source);
+	}
+	while (!info && (mnt = getmntent_r(f, &entry, line, sizeof(line))))
+		_index_mount(index, 0, mnt->mnt_fsname);
+
+	if (info)
+		fclose(f);
+	else
+		endmntent(f);
+	return 0;
+
+fail:
+	if (info)
+		fclose(f);
+	else
+		endmntent(f);
+	clean_mountindex(index);
+	return -1;
+}
+
+/* A block device is looked up by its number, anything else by name */
+static int checkmount(const struct mountindex *index, const char *device_name)
+{
+	struct stat devstat;
+	unsigned int slot;
+
+	if (!index->dev)
+		return 0;
+	if (stat(device_name, &devstat) == 0 && S_ISBLK(devstat.st_mode)) {
+		for (slot = _hash_dev(devstat.st_rdev) & index->devmask;
+			index->dev[slot]; slot = (slot + 1) & index->devmask)
+			if (index->dev[slot] == devstat.st_rdev)
+				goto mounted;
 		return 0;
+	}
+	for (slot = _hash_name(device_name) & index->namemask;
+		index->name[slot]; slot = (slot + 1) & index->namemask)
+		if (strcmp(index->name[slot], device_name) == 0)
+			goto mounted;
+	return 0;
+
+mounted:
 	printf("%s already mounted - will not format as VMUFAT\n", device_name);
 	return -1;
 }
 
-static int readforbad(struct badblocklist** root, const char* filename, int verbose)
+/*
+ * The list file, mapped if it can be; otherwise (a pipe, say) read in
+ * whole. *mapped says which, for _release_list().
+ */
+static char *_load_list(int fd, size_t *length, int *mapped)
 {
-	int error = 0;
-	FILE *listfile;
-	int badblocks = 0;
-	unsigned long blockno;
-	struct badblocklist *lastbadblock = NULL;
+	struct stat liststat;
+	char *buf, *grown;
+	size_t room = 65536;
+	ssize_t got;
 
-	listfile = fopen(filename, "r");
-	if (listfile == NULL) {
+	*length = 0;
+	*mapped = 0;
+	if (fstat(fd, &liststat) == 0 && S_ISREG(liststat.st_mode)) {
+		/* An empty list has nothing to map */
+		if (!liststat.st_size)
+			return malloc(1);
+		buf = mmap(NULL, liststat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (buf != MAP_FAILED) {
+			madvise(buf, liststat.st_size, MADV_SEQUENTIAL);
+			*length = liststat.st_size;
+			*mapped = 1;
+			return buf;
+		}
+	}
+
+	if (!(buf = malloc(room)))
+		return NULL;
+	while ((got = read(fd, buf + *length, room - *length)) > 0) {
+		*length += got;
+		if (*length < room)
+			continue;
+		if (!(grown = realloc(buf, room *= 2))) {
+			free(buf);
+			return NULL;
+		}
+		buf = grown;
+	}
+	if (got < 0) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+static void _release_list(char *buf, size_t length, int mapped)
+{
+	if (mapped)
+		munmap(buf, length);
+	else
+		free(buf);
+}
+
+/* A decimal number at *at, which is left just past it */
+static int _scan_number(const char **at, const char *end,
+	unsigned long *value)
+{
+	const char *digit = *at;
+	unsigned long number = 0;
+
+	if (digit == end || *digit < '0' || *digit > '9')
+		return -1;
+	for (; digit < end && *digit >= '0' && *digit <= '9'; digit++) {
+		if (number > (ULONG_MAX - (*digit - '0')) / 10)
+			return -1;
+		number = number * 10 + (*digit - '0');
+	}
+	*at = digit;
+	*value = number;
+	return 0;
+}
+
+/*
+ * Bad blocks from a list such as badblocks writes: block numbers, or
+ * ranges such as 100-250, separated by white space, with '#' starting
+ * a comment up to the end of the line. The scan journal is written in
+ * the same form. Each entry goes straight into the set.
+ */
+static int readforbad(struct vmubadblocks *set, const char* filename,
+	int verbose)
+{
+	int fd, mapped, error = -1;
+	int line = 1;
+	char *list;
+	const char *at, *end;
+	size_t length;
+	unsigned long first, last;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
 		printf("Could not open %s\n", filename);
-		error = -1;
 		goto out;
 	}
+	list = _load_list(fd, &length, &mapped);
+	if (!list) {
+		printf("Could not read %s\n", filename);
+		goto close;
+	}
 
-	while (!feof(listfile)) {
-		if (fscanf(listfile, "%lu\n", &blockno) != 1) {
-			printf("Cannot parse %s at line %i\n", filename,
-				badblocks + 1);
-			error = -1;
-			goto close;
+	for (at = list, end = list + length; at < end; ) {
+		switch (*at) {
+		case '\n':
+			line++;
+			/* fall through */
+		case ' ':
+		case '\t':
+		case '\r':
+			at++;
+			continue;
+		case '#':
+			while (at < end && *at != '\n')
+				at++;
+			continue;
 		}
-		lastbadblock = _add_badblock(lastbadblock, blockno);
-		if (!lastbadblock) {
-			printf("Memory failure\n");
-			error = -1;
-			goto close;
+		if (_scan_number(&at, end, &first) < 0)
+			goto bad;
+		last = first;
+		if (at < end && *at == '-') {
+			at++;
+			if (_scan_number(&at, end, &last) < 0 || last < first)
+				goto bad;
 		}
-		else if (*root == NULL)
-			*root = lastbadblock;
-		if (verbose)
-			printf("Bad block at %lu noted.\n", blockno);
-		badblocks++;
-	}	
+		if (at < end && !memchr(" \t\r\n#", *at, 5))
+			goto bad;
+		if (vmufat_add_badblocks(set, first, last) && verbose) {
+			if (first == last)
+				printf("Bad block at %lu noted.\n", first);
+			else
+				printf("Bad blocks %lu to %lu noted.\n",
+					first, last);
+		}
+	}
+	error = 0;
+	goto release;
 
+bad:
+	printf("Cannot parse %s at line %i\n", filename, line);
+release:
+	_release_list(list, length, mapped);
 close:
-	fclose(listfile);
+	close(fd);
 out:
 	return error;
 }
 
-static unsigned int _round_down(unsigned int x)
+static void print_vmuparams(const struct vmudev *dev,
+	const struct vmuparam *param)
 {
-	unsigned int y = 0x80000000;
-	while (y > x)
-		y = y >> 1;
-	return y;
+	if (dev->isblk)
+		printf("Device sectors: %u octets logical, %u physical\n",
+			dev->logical, dev->physical);
+	printf("VMUFAT file system: Root block at %i\n", param->rootblock);
+	printf("\tFAT of length %i begins at %i\n", param->fatsize,
+		param->fatstart);
+	printf("\tDirectory of length %i begins at %i\n", param->dirsize,
+		param->dirstart);
 }
 
-static int calculate_vmuparams(int device_numb, struct vmuparam *param,
-	int blocknum, int verbose)
+/* How the journal header names a -c read scan and a -w write test */
+static const char *_journal_kind(int destructive)
 {
-	int error = 0;
-	off_t size;
-	struct stat devstat;
-	
-	if (fstat(device_numb, &devstat) < 0) {
-		printf("Could not stat device.\n");
-		error = -1;
-		goto out;
+	return destructive ? "write-test" : "read-scan";
+}
+
+/*
+ * Record progress in a form -l can read: a comment saying which scan
+ * this is and how far it has got, then the bad blocks found so far. It
+ * is written aside and renamed into place, so an interruption never
+ * leaves half of one.
+ */
+static int _write_journal(const char *name, const struct vmubadblocks *set,
+	unsigned int scanned, int destructive)
+{
+	char tmpname[PATH_MAX];
+	unsigned int block;
+	FILE *journal;
+	int fd, error = -1;
+
+	if (snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", name)
+		>= sizeof(tmpname))
+		return -1;
+	fd = mkstemp(tmpname);
+	if (fd < 0)
+		return -1;
+	journal = fdopen(fd, "w");
+	if (!journal) {
+		close(fd);
+		goto unlink;
 	}
-	size = devstat.st_size;
-	if ((size < BLOCKSIZE * 4) ||(blocknum > 0 && blocknum < 4)) {
-		printf("Device just %lu octets in size. Too small for"
-			" VMUFAT volume\n", size);
+	fprintf(journal, "# vmufat %s journal: %u of %u blocks scanned\n",
+		_journal_kind(destructive), scanned, set->blocks);
+	for (block = vmufat_next_badblock(set, 0); block < set->blocks;
+		block = vmufat_next_badblock(set, block + 1))
+		fprintf(journal, "%u\n", block);
+	if (fflush(journal) == 0 && fdatasync(fd) == 0
+		&& fchmod(fd, 0644) == 0)
+		error = 0;
+	if (fclose(journal) != 0)
 		error = -1;
-		goto out;
+	if (error == 0 && rename(tmpname, name) == 0)
+		return 0;
+unlink:
+	unlink(tmpname);
+	return -1;
+}
+
+/*
+ * Pick up the bad blocks and high-water mark of an interrupted scan. A
+ * finished one is scanned again from the start, and one left by the
+ * other kind of scan is refused rather than resumed.
+ */
+static int _read_journal(struct vmubadblocks *set, const char *journal,
+	unsigned int *resume, int destructive, int verbose)
+{
+	FILE *in;
+	char kind[16];
+	unsigned int scanned, blocks;
+	int matched;
+
+	*resume = 0;
+	in = fopen(journal, "r");
+	if (!in)
+		return 0;
+	matched = fscanf(in, "# vmufat %15s journal: %u of %u blocks scanned",
+		kind, &scanned, &blocks);
+	fclose(in);
+	/* Anything else there, a -l list say, is not ours to replace */
+	if (matched != EOF && matched < 1) {
+		printf("%s is not a scan journal - will not overwrite it\n",
+			journal);
+		return -1;
 	}
-	else if (size < blocknum * BLOCKSIZE) {
-		printf("Device only %lu octets in size. Too small for"
-			" your request of %i blocks\n", size, blocknum);
-		error = -1;
-		goto out;
+	if (matched == 3 && strcmp(kind, _journal_kind(!destructive)) == 0) {
+		printf("Scan journal %s is from a %s, not a %s\n", journal,
+			kind, _journal_kind(destructive));
+		return -1;
 	}
-	else if (blocknum)
-		size = blocknum * BLOCKSIZE;
-
-	param->size = _round_down(size >> BLOCKSHIFT) << BLOCKSHIFT;
-	param->rootblock = (param->size >> BLOCKSHIFT) - 1;
-	param->fatstart = param->rootblock - 1;
-	param->fatsize = (2 * (param->size >> BLOCKSHIFT)) >> BLOCKSHIFT;
-	if (param->fatsize < 1)
-		param->fatsize = 1;
-	param->dirstart = param->fatstart - param->fatsize;
-	/* Remainder divided in ratio 16:1 between user blocks and directory */
-	param->dirsize = ((param->size >> BLOCKSHIFT)
-		- (1 + param->fatsize)) / 17;
-	if (param->dirsize < 1)
-		param->dirsize = 1;
-	if (verbose) {
-		printf("VMUFAT file system: Root block at %i\n",
-			param->rootblock);
-		printf("\tFAT of length %i begins at %i\n", param->fatsize,
-			param->fatstart);
-		printf("\tDirectory of length %i begins at %i\n",
-			param->dirsize, param->dirstart);
+	if (matched != 3 || strcmp(kind, _journal_kind(destructive)) != 0
+		|| blocks != set->blocks || scanned > blocks) {
+		printf("Ignoring scan journal %s - not for this volume\n",
+			journal);
+		return 0;
 	}
-out:
-	return error;
+	if (scanned == blocks) {
+		if (verbose)
+			printf("Scan journal %s is complete - scanning"
+				" again\n", journal);
+		return 0;
+	}
+	if (readforbad(set, journal, verbose) < 0)
+		return -1;
+	*resume = scanned;
+	if (verbose)
+		printf("Resuming scan at block %u\n", scanned);
+	return 0;
 }
 
-static char _i2bcd(unsigned int i)
+/*
+ * Blocks done, throughput and time left, at most once every STATUSSECS
+ * (LOGSTATUSSECS when not live) however small the extents get, so a
+ * slow terminal never holds up the scan. The final update always shows.
+ * A write test's percentage and time left cover all of its passes.
+ */
+static void _scan_status(struct scanreport *report, unsigned int scanned)
 {
-	char bcd;
-	unsigned int digit;
-	digit = i/10;
-	bcd = digit << 4;
-	digit = i % 10;
-	bcd += digit;
-	return bcd;
+	unsigned int blocks = report->set->blocks;
+	unsigned long long done, total;
+	double secs, rate, left;
+	unsigned long eta;
+	char pass[32] = "";
+	int finished = scanned >= blocks
+		&& report->pass + 1 >= report->passes;
+
+	if (!finished && vmufat_elapsed_seconds(&report->lastshown)
+		< (report->live ? STATUSSECS : LOGSTATUSSECS))
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &report->lastshown);
+	total = (unsigned long long)report->passes * (blocks - report->from);
+	done = (unsigned long long)report->pass * (blocks - report->from)
+		+ scanned - report->from;
+	secs = vmufat_elapsed_seconds(&report->began);
+	rate = secs > 0 ? done / secs : 0;
+	left = rate > 0 ? (total - done) / rate : 0;
+	eta = (finished ? secs : left) + 0.5;
+	if (report->passes > 1)
+		snprintf(pass, sizeof(pass), " pass %u of %u,",
+			report->pass + 1, report->passes);
+	printf("%s%s:%s %u of %u blocks (%u%%), %.1f MB/s, %lu:%02lu:%02lu"
+		" %s%s", report->live ? "\r" : "", report->device_name, pass,
+		scanned, blocks, (unsigned int)(total ? 100 * done / total
+		: 100), rate * VMU_BLOCKSIZE / 1e6, eta / 3600, eta / 60 % 60,
+		eta % 60, finished ? "taken" : "left",
+		report->live && !finished ? "  " : "\n");
+	fflush(stdout);
+	report->showing = report->live && !finished;
 }
 
-static int mark_fat(int device_numb, const struct vmuparam *param, int verbose)
+/* Called by scanforbad() or vmufat_writetest() with the scan serialised */
+static void _scan_report(void *arg, int event, unsigned int start,
+	unsigned int count)
 {
-	char *buffer;
-	uint16_t *buf;
-	int i, j, k, start;
-	int error = -1;
-	
-	buffer = malloc(BLOCKSIZE);
-	if (!buffer)
-		goto nomem;
-	
-	buf = (uint16_t *)buffer;
-	for (i = 0; i < BLOCKSIZE / 2; i++)
-		buf[i] = __cpu_to_le16(0xFFFC);
-
-	if (param->fatsize > 1) {
-		for (i = param->fatstart - 1;
-			i > param->fatstart - param->fatsize; i--) {
-			if (pwrite(device_numb, buffer, BLOCKSIZE,
-				i * BLOCKSIZE) < BLOCKSIZE)
-				goto badwrite;
-		}
-	}
-
-	/* Mark for the FAT and Directory */
-	start = 2 * (param->fatsize + param->dirsize) /  BLOCKSIZE + 1;
-	for (j = param->rootblock - start; j < param->rootblock; j++) {
-		k = (j - param->dirstart - 1) * BLOCKSIZE;
-		for (i = 0; i < BLOCKSIZE; i = i + 2) {
-			/* Root or unreachable blocks */
-			if ((k + i) / 2 >= param->rootblock)
-				buf[i / 2] = __cpu_to_le16(0xFFFA); 
-			/* FAT */
-			else if ((k + i) / 2 > 1 + param->fatstart
-				- param->fatsize)
-				buf[i / 2] = __cpu_to_le16((k + i) / 2 - 1);
-			else if ((k + i) / 2 == 1 + param->fatstart
-				- param->fatsize)
-				buf[i / 2] = __cpu_to_le16(0xFFFA);
-			/* Directory */
-			else if ((k + i) / 2 >  1 + param->dirstart 
-				- param->dirsize)
-				buf[i / 2] = __cpu_to_le16((k + i) / 2 - 1);
-			else if ((k + i) / 2 == 1 + param->dirstart
-				- param->dirsize)
-				buf[i / 2] = __cpu_to_le16(0xFFFA);
-			else
-				buf[i/2] = __cpu_to_le16(0xFFFC);
+	struct scanreport *report = arg;
+	const unsigned int longbits = 8 * sizeof(unsigned long);
+	time_t now;
+
+	switch (event) {
+	case VMU_SCAN_BAD:
+		if (report->showing)
+			printf("\n");
+		report->showing = 0;
+		printf(report->destructive ? "Block %i fails write test\n"
+			: "Block %i gives bad read\n", start);
+		break;
+	case VMU_SCAN_PASS:
+		report->pass = start;
+		report->passes = count;
+		break;
+	case VMU_SCAN_PROGRESS:
+		if (report->verbose > 0)
+			_scan_status(report, start);
+		if (!report->journal)
+			break;
+		/* Only the last pass takes a block through every pattern */
+		if (report->pass + 1 < report->passes)
+			start = report->from;
+		now = time(NULL);
+		if (now - report->lastcheck < CHECKPOINTSECS)
+			break;
+		report->lastcheck = now;
+		/* No journal thread to be had - write it from here */
+		if (!report->writing) {
+			if (_write_journal(report->journal, report->set, start,
+				report->destructive) < 0)
+				printf("Could not write scan journal %s\n",
+					report->journal);
+			break;
 		}
-		if (pwrite(device_numb, buffer, BLOCKSIZE, j * BLOCKSIZE) 
-			< BLOCKSIZE)
-			goto badwrite;
+		pthread_mutex_lock(&report->lock);
+		memcpy(report->pending.map, report->set->map,
+			(report->set->blocks + longbits - 1) / longbits
+			* sizeof(unsigned long));
+		report->pending.count = report->set->count;
+		report->scanned = start;
+		report->due = 1;
+		pthread_cond_signal(&report->wake);
+		pthread_mutex_unlock(&report->lock);
+		break;
 	}
-
-	if (verbose)
-		printf("FAT written\n");
-	error = 0;
-	goto clean;
-
-nomem:
-	printf("Memory allocation failed.\n");		
-	goto out;
-badwrite:
-	printf("FAT write failed.\n");
-clean:
-	free(buffer);
-out:
-	return error;
 }
-		
 
-static void _fill_root_block(char *buf, const struct vmuparam *param)
+/* Write out each checkpoint the scan hands over, until told to stop */
+static void *_journal_writer(void *arg)
 {
-	int i;
-	time_t rawtime;
-	struct tm *ptm;
-	char century, year, month, day, hour, minute, second, weekday;
-	uint16_t *wordbuf;
+	struct scanreport *report = arg;
+	struct vmubadblocks swap;
+	unsigned int scanned;
 
-	wordbuf = (uint16_t *)buf;
+	pthread_mutex_lock(&report->lock);
+	while (1) {
+		while (!report->due && !report->stop)
+			pthread_cond_wait(&report->wake, &report->lock);
+		if (!report->due)
+			break;
+		swap = report->written;
+		report->written = report->pending;
+		report->pending = swap;
+		scanned = report->scanned;
+		report->due = 0;
+		pthread_mutex_unlock(&report->lock);
 
-	for (i = 0; i < 0x10; i++)
-		buf[i] = 0x55;
+		if (_write_journal(report->journal, &report->written, scanned,
+			report->destructive) < 0)
+			printf("Could not write scan journal %s\n",
+				report->journal);
+		pthread_mutex_lock(&report->lock);
+	}
+	pthread_mutex_unlock(&report->lock);
+	return NULL;
+}
 
-	time(&rawtime);
-	ptm = gmtime(&rawtime);
-	if (!ptm)
+static void _start_journal(struct scanreport *report)
+{
+	pthread_mutex_init(&report->lock, NULL);
+	pthread_cond_init(&report->wake, NULL);
+	if (vmufat_init_badblocks(&report->pending, report->set->blocks) < 0)
+		return;
+	if (vmufat_init_badblocks(&report->written, report->set->blocks) < 0)
+		goto pending;
+	if (pthread_create(&report->writer, NULL, _journal_writer,
+		report) == 0) {
+		report->writing = 1;
 		return;
-	century = _i2bcd(19 + ptm->tm_year / 100);
-	year = _i2bcd(ptm->tm_year - (ptm->tm_year /100) * 100);
-	month = _i2bcd(ptm->tm_mon + 1);
-	day = _i2bcd(ptm->tm_mday);
-	hour = _i2bcd(ptm->tm_hour);
-	minute = _i2bcd(ptm->tm_min);
-	second = _i2bcd(ptm->tm_sec);
-	weekday = _i2bcd(ptm->tm_wday);
-
-	buf[0x30] = century;
-	buf[0x31] = year;
-	buf[0x32] = month;
-	buf[0x33] = day;
-	buf[0x34] = hour;
-	buf[0x35] = minute;
-	buf[0x36] = second;
-	buf[0x37] = weekday;
-
-	wordbuf[0x20] = __cpu_to_le16(param->rootblock);
-	wordbuf[0x22] = __cpu_to_le16(param->rootblock);
-	wordbuf[0x23] = __cpu_to_le16(param->fatstart);
-	wordbuf[0x24] = __cpu_to_le16(param->fatsize);
-	wordbuf[0x25] = __cpu_to_le16(param->dirstart);
-	wordbuf[0x26] = __cpu_to_le16(param->dirsize);
-	/* 32 octets per directory entry */
-	wordbuf[0x27] = __cpu_to_le16(param->dirsize * 8);
-}	
-
-static int mark_root_block(int device_numb, const struct vmuparam *param, int verbose)
-{
-	char *zilches;
-	int i, error = 0;
-	zilches = malloc(BLOCKSIZE);
-	if (!zilches) {
-		printf("Memory allocation failed.\n");
-		error = -1;
-		goto out;
 	}
+	vmufat_clean_badblocks(&report->written);
+pending:
+	vmufat_clean_badblocks(&report->pending);
+}
 
-	memset(zilches, '\0', BLOCKSIZE);
-	_fill_root_block(zilches, param);
-	if (pwrite(device_numb, zilches, BLOCKSIZE,
-		param->rootblock * BLOCKSIZE) < BLOCKSIZE) {
-		printf("Could not write root block\n");
-		error = -1;
-		goto clean;
-	}
-	if (verbose) {
-		printf("Root block written to block %i\n", param->rootblock);
-		printf("BCD string: %c %c %c %c %c %c %c %c\n",
-			zilches[0x30], zilches[0x31], zilches[0x32],
-			zilches[0x33], zilches[0x34], zilches[0x35],
-			zilches[0x36], zilches[0x37]);
+/* Let the journal thread finish the last checkpoint it was given */
+static void _stop_journal(struct scanreport *report)
+{
+	if (report->writing) {
+		pthread_mutex_lock(&report->lock);
+		report->stop = 1;
+		pthread_cond_signal(&report->wake);
+		pthread_mutex_unlock(&report->lock);
+		pthread_join(report->writer, NULL);
+		vmufat_clean_badblocks(&report->written);
+		vmufat_clean_badblocks(&report->pending);
 	}
-	
-clean:
-	free(zilches);
-out:
+	pthread_cond_destroy(&report->wake);
+	pthread_mutex_destroy(&report->lock);
+}
+
+static int scan_volume(struct vmudev *dev, struct vmubadblocks *set,
+	const char *device_name, const char *journal, int destructive,
+	int verbose, int live)
+{
+	int error;
+	struct scanreport report = {
+		.set = set,
+		.device_name = device_name,
+		.journal = journal,
+		.lastcheck = time(NULL),
+		.destructive = destructive,
+		.verbose = verbose,
+		.live = live,
+		.pass = 0,
+		.passes = 1,
+	};
+	struct vmuscan scan = {
+		.from = 0,
+		.notify = _scan_report,
+		.arg = &report,
+	};
+
+	if (journal && _read_journal(set, journal, &scan.from, destructive,
+		verbose) < 0)
+		return -1;
+	report.from = scan.from;
+	clock_gettime(CLOCK_MONOTONIC, &report.began);
+	report.lastshown = report.began;
+	if (journal)
+		_start_journal(&report);
+	if (destructive)
+		error = vmufat_writetest(dev, set, &scan);
+	else
+		error = scanforbad(dev, set, &scan);
+	if (journal)
+		_stop_journal(&report);
+	if (report.showing)
+		printf("\n");
+	if (error < 0)
+		printf("Surface scan fails: %s\n", strerror(-error));
+	else if (journal && _write_journal(journal, set, set->blocks,
+		destructive) < 0)
+		printf("Could not write scan journal %s\n", journal);
+	return error;
+}
+
+static void clean_system_image(struct vmuimage *image)
+{
+	free(image->buffer);
+	image->buffer = NULL;
+}
+
+static int _golden_name(char *name, size_t length, const char *cachedir,
+	const struct vmuparam *param)
+{
+	if (snprintf(name, length, "%s/vmufat-%u.img", cachedir,
+		param->size >> VMU_BLOCKSHIFT) >= length)
+		return -1;
+	return 0;
+}
+
+/*
+ * FNV-1a over the image a word at a time, kept after the blocks in the
+ * cache file so a damaged directory or FAT is not copied into volumes
+ */
+static uint64_t _golden_sum(const struct vmuimage *golden)
+{
+	const uint64_t *word = (const uint64_t *)golden->buffer;
+	uint64_t sum = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < golden->blocks * VMU_BLOCKSIZE / 8; i++)
+		sum = (sum ^ word[i]) * 0x100000001b3ULL;
+	return sum;
+}
+
+/*
+ * Only trust a cached image whose size, root block geometry and
+ * checksum all match
+ */
+static int _load_golden_image(struct vmuimage *golden,
+	const struct vmuparam *param, const char *cachedir)
+{
+	char name[PATH_MAX];
+	char expect[VMU_BLOCKSIZE];
+	uint64_t sum;
+	FILE *cache;
+	int error = -1;
+
+	if (_golden_name(name, sizeof(name), cachedir, param) < 0)
+		return -1;
+	cache = fopen(name, "r");
+	if (!cache)
+		return -1;
+	if (fread(golden->buffer, VMU_BLOCKSIZE, golden->blocks, cache)
+		!= golden->blocks || fread(&sum, sizeof(sum), 1, cache) != 1
+		|| fgetc(cache) != EOF)
+		goto close;
+	memset(expect, 0, VMU_BLOCKSIZE);
+	fill_root_block(expect, param);
+	if (memcmp(expect, vmufat_image_block(golden, param->rootblock),
+		VMU_BLOCKSIZE) == 0 && sum == _golden_sum(golden))
+		error = 0;
+close:
+	fclose(cache);
+	return error;
+}
+
+/* Write to a temporary file and rename, so readers never see half */
+static int _save_golden_image(const struct vmuimage *golden,
+	const struct vmuparam *param, const char *cachedir)
+{
+	char name[PATH_MAX], tmpname[PATH_MAX];
+	uint64_t sum = _golden_sum(golden);
+	int fd, error = -1;
+
+	if (_golden_name(name, sizeof(name), cachedir, param) < 0
+		|| snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", name)
+		>= sizeof(tmpname))
+		return -1;
+	fd = mkstemp(tmpname);
+	if (fd < 0)
+		return -1;
+	if (write(fd, golden->buffer, golden->blocks * VMU_BLOCKSIZE)
+		== golden->blocks * VMU_BLOCKSIZE
+		&& write(fd, &sum, sizeof(sum)) == sizeof(sum)
+		&& fchmod(fd, 0644) == 0
+		&& rename(tmpname, name) == 0)
+		error = 0;
+	close(fd);
+	if (error < 0)
+		unlink(tmpname);
 	return error;
 }
 
-static int zero_blocks(int device_numb, const struct vmuparam *param, int verbose)
+/*
+ * Everything in the system region that depends only on the geometry:
+ * the directory, the FAT and the root block without its timestamp.
+ * The stock 256-block geometry is built in; otherwise, with a cache
+ * directory it is read from there when present and saved there when not.
+ */
+static int build_golden_image(struct vmuimage *golden,
+	const struct vmuparam *param, const char *cachedir,
+	struct vmubench *bench, int verbose)
 {
-	char *zilches;
-	int i, error = -1;
-	zilches = malloc(BLOCKSIZE);
-	if (!zilches) {
+	char *buffer;
+
+	unsigned int dirlow = param->dirstart + 1 - param->dirsize;
+
+	buffer = calloc(vmufat_system_image_blocks(param, dirlow, 1),
+		VMU_BLOCKSIZE);
+	if (!buffer) {
 		printf("Memory allocation failed.\n");
-		goto out;
+		return -1;
 	}
+	vmufat_init_system_image(golden, param, dirlow, 1, buffer);
 
-	memset(zilches, '\0', BLOCKSIZE);
+	bench_begin(bench, NULL);
+	if (vmufat_standard_system_image(golden, param) == 0) {
+		bench_end(bench, NULL, "standard_system_image");
+		if (verbose)
+			printf("Built-in system blocks used\n");
+		return 0;
+	}
 
-	for (i = 0; i <= param->dirstart; i++) {
-		if (pwrite(device_numb, zilches, BLOCKSIZE,
-			i * BLOCKSIZE) < BLOCKSIZE) {
-			printf("Write failed on device\n");
-			goto clean;
+	if (cachedir) {
+		bench_begin(bench, NULL);
+		if (_load_golden_image(golden, param, cachedir) == 0) {
+			bench_end(bench, NULL, "load_golden_image");
+			if (verbose)
+				printf("System blocks read from cache in %s\n",
+					cachedir);
+			return 0;
 		}
+		memset(golden->buffer, 0, golden->blocks * VMU_BLOCKSIZE);
 	}
-	error = 0;
+
+	bench_begin(bench, NULL);
+	mark_root_block(golden, param);
+	bench_end(bench, NULL, "mark_root_block");
 	if (verbose)
-		printf("Other blocks zeroed\n");
-clean:
-	free(zilches);
-out:
-	return error;
+		printf("Root block built for block %i\n", param->rootblock);
+	bench_begin(bench, NULL);
+	mark_fat(golden, param);
+	bench_end(bench, NULL, "mark_fat");
+	if (verbose)
+		printf("FAT built\n");
+
+	if (cachedir && _save_golden_image(golden, param, cachedir) < 0)
+		printf("Could not save system blocks to cache in %s\n",
+			cachedir);
+	return 0;
 }
-		
 
-static int scanforbad(int device_numb, struct badblocklist** root, int verbose)
+/* Build it under the batch lock the first time a target needs it */
+static const struct vmuimage *get_golden_image(struct batchjob *job,
+	const struct vmuparam *param, struct vmubench *bench)
 {
-	int error = 0, i;
-	struct badblocklist *lastbadblock = NULL;
-	off_t size;
-	long got;
-	struct stat devstat; 
-	char *buffer = malloc(BLOCKSIZE);
-	if (!buffer) {
-		error = -1;
+	struct goldenimage *golden;
+
+	pthread_mutex_lock(&job->lock);
+	for (golden = job->golden; golden; golden = golden->next)
+		if (golden->param.size == param->size)
+			goto out;
+	golden = malloc(sizeof(*golden));
+	if (!golden) {
 		printf("Memory allocation failed.\n");
 		goto out;
 	}
-	
-	if (fstat(device_numb, &devstat) < 0) {
-		printf("Could not stat device.\n");
-		error = -1;
-		goto clean;
-	}
-
-	size = devstat.st_size;
-
-	for (i = 0; i < size/BLOCKSIZE; i++)
-	{
-		if (verbose > 0)
-			printf("Testing block %i\n", i);
-		got = pread(device_numb, buffer, BLOCKSIZE, i * BLOCKSIZE);
-		if (got != BLOCKSIZE) {
-			printf("Block %i gives bad read\n", i);
-			lastbadblock = _add_badblock(lastbadblock, i);
-			if (!lastbadblock) {
-				printf("Memory failure\n");
-				error = -1;
-				goto clean;
+	golden->param = *param;
+	if (build_golden_image(&golden->image, param, job->opts->cachedir,
+		bench, job->opts->verbose) < 0) {
+		free(golden);
+		golden = NULL;
+		goto out;
+	}
+	golden->next = job->golden;
+	job->golden = golden;
+out:
+	pthread_mutex_unlock(&job->lock);
+	return golden ? &golden->image : NULL;
+}
+
+/*
+ * Assemble everything from the bottom of the directory to the root
+ * block - directory, FAT with bad blocks marked, root block - in one
+ * buffer so it can go to the device in a single write. Only the
+ * timestamp and bad blocks are new; the rest comes from the golden
+ * image. Blocks from lowest up to the directory are zeroed for -d files.
+ */
+static int build_system_image(struct vmuimage *image,
+	const struct vmuimage *golden, const struct vmuparam *param,
+	const struct vmubadblocks *badblocks, unsigned int lowest,
+	unsigned int align, struct vmubench *bench, int verbose)
+{
+	char *buffer, *rootblock;
+
+	/* Page aligned, so it can be written with O_DIRECT */
+	if (posix_memalign((void **)&buffer, sysconf(_SC_PAGESIZE),
+		vmufat_system_image_blocks(param, lowest, align)
+		* VMU_BLOCKSIZE) != 0) {
+		printf("Memory allocation failed.\n");
+		return -1;
+	}
+	vmufat_init_system_image(image, param, lowest, align, buffer);
+	vmufat_copy_system_image(image, golden);
+
+	bench_begin(bench, NULL);
+	vmufat_stamp_root_block(image, param);
+	bench_end(bench, NULL, "stamp_root_block");
+	if (verbose) {
+		rootblock = vmufat_image_block(image, param->rootblock);
+		printf("BCD string: %c %c %c %c %c %c %c %c\n",
+			rootblock[0x30], rootblock[0x31], rootblock[0x32],
+			rootblock[0x33], rootblock[0x34], rootblock[0x35],
+			rootblock[0x36], rootblock[0x37]);
+	}
+	bench_begin(bench, NULL);
+	if (mark_bad_blocks(image, badblocks, param) < 0) {
+		printf("Format fails as system block is bad\n");
+		goto fail;
+	}
+	bench_end(bench, NULL, "mark_bad_blocks");
+	if (verbose && badblocks->count)
+		printf("Bad blocks now marked off in FAT.\n");
+	return 0;
+
+fail:
+	clean_system_image(image);
+	return -1;
+}
+
+static int _by_name(const void *a, const void *b)
+{
+	return strcmp(((const struct srcfile *)a)->name,
+		((const struct srcfile *)b)->name);
+}
+
+/*
+ * The regular files in dirname, sorted by name so every image made from
+ * it is the same, and how many blocks they need between them.
+ */
+static int readsourcedir(const char *dirname, struct srcfile **files,
+	int *count, unsigned int *blocks)
+{
+	DIR *dir;
+	struct dirent *dent;
+	struct stat filestat;
+	struct srcfile *grown;
+	int room = 0, error = -1;
+
+	*files = NULL;
+	*count = 0;
+	*blocks = 0;
+	dir = opendir(dirname);
+	if (!dir) {
+		printf("Could not open directory %s\n", dirname);
+		return -1;
+	}
+	while ((dent = readdir(dir))) {
+		if (fstatat(dirfd(dir), dent->d_name, &filestat, 0) < 0
+			|| !S_ISREG(filestat.st_mode))
+			continue;
+		if (strlen(dent->d_name) > 12) {
+			printf("%s/%s: VMUFAT names are at most 12 octets\n",
+				dirname, dent->d_name);
+			goto close;
+		}
+		if (*count >= room) {
+			room = room ? room * 2 : 16;
+			grown = realloc(*files, room * sizeof(struct srcfile));
+			if (!grown) {
+				printf("Memory allocation failed.\n");
+				goto close;
 			}
-			else if (*root == NULL)
-				*root = lastbadblock;
+			*files = grown;
 		}
+		strcpy((*files)[*count].name, dent->d_name);
+		(*files)[*count].size = filestat.st_size;
+		(*files)[*count].mtime = filestat.st_mtime;
+		(*count)++;
+		*blocks += filestat.st_size ? (filestat.st_size
+			+ VMU_BLOCKSIZE - 1) / VMU_BLOCKSIZE : 1;
+	}
+	qsort(*files, *count, sizeof(struct srcfile), _by_name);
+	error = 0;
+close:
+	closedir(dir);
+	if (error < 0) {
+		free(*files);
+		*files = NULL;
 	}
-clean:
-	free(buffer);
-out:
 	return error;
 }
 
-static int _mark_block_bad(int device_numb, int badblock,
-	const struct vmuparam *param)
+/* Read length octets of fd into buf, failing if the file comes up short */
+static int _read_fully(int fd, char *buf, size_t length)
 {
-	int error = -1;
-	int fatblock;
-	char *buffer;
-	uint16_t *buf;
-	buffer = malloc(BLOCKSIZE);
-	if (!buffer) {
-		printf("Memory allocation failed\n");
-		goto out;
+	ssize_t got;
+
+	while (length > 0) {
+		got = read(fd, buf, length);
+		if (got <= 0)
+			return -1;
+		buf += got;
+		length -= got;
 	}
+	return 0;
+}
 
-	fatblock = (2 * badblock) / BLOCKSIZE + param->dirstart + 1;
-	if (pread(device_numb, buffer, BLOCKSIZE, fatblock * BLOCKSIZE) != BLOCKSIZE)
-		goto clean;
-	buf = (uint16_t *)buffer;
-	buf[badblock % (BLOCKSIZE / 2)] = __cpu_to_le16(0xFFFA);
-	if (pwrite(device_numb, buffer, BLOCKSIZE,
-		fatblock * BLOCKSIZE) != BLOCKSIZE)
-		goto clean;
+/*
+ * Give each file its blocks and directory entry, then read it straight
+ * into the image, one read for each run of consecutive blocks. The
+ * image must reach down to vmufat_data_base() for the files.
+ */
+static int populate_image(struct vmuimage *image,
+	const struct vmuparam *param, const char *dirname,
+	const struct srcfile *files, int count, unsigned int lowest,
+	int verbose)
+{
+	int i, dir, fd, error = -1;
+	unsigned int cursor = lowest, start, block, run;
+	size_t left, chunk;
+
+	dir = open(dirname, O_RDONLY | O_DIRECTORY);
+	if (dir < 0) {
+		printf("Could not open directory %s\n", dirname);
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		if (vmufat_add_file(image, param, files[i].name, files[i].size,
+			files[i].mtime, &cursor, &start) < 0) {
+			printf("No room on the volume for %s/%s\n", dirname,
+				files[i].name);
+			goto close;
+		}
+		fd = openat(dir, files[i].name, O_RDONLY);
+		if (fd < 0) {
+			printf("Could not open %s/%s\n", dirname,
+				files[i].name);
+			goto close;
+		}
+		for (block = start, left = files[i].size; left > 0;
+			block = vmufat_fat_next(image, param,
+				block + run - 1)) {
+			for (run = 1; run * VMU_BLOCKSIZE < left
+				&& vmufat_fat_next(image, param,
+				block + run - 1) == block + run; run++)
+				;
+			chunk = run * VMU_BLOCKSIZE < left
+				? run * VMU_BLOCKSIZE : left;
+			if (_read_fully(fd, vmufat_image_block(image, block),
+				chunk) < 0) {
+				printf("Could not read %s/%s\n", dirname,
+					files[i].name);
+				close(fd);
+				goto close;
+			}
+			left -= chunk;
+		}
+		close(fd);
+		if (verbose)
+			printf("%s copied to the volume from block %u\n",
+				files[i].name, start);
+	}
 	error = 0;
-clean:
-	free(buffer);
-out:
+close:
+	close(dir);
 	return error;
+}
 
+/*
+ * Standard output as the target. There is nowhere to seek, so the
+ * volume goes out strictly in order, and messages are moved to stderr
+ * to keep them out of it.
+ */
+static int open_stream(struct vmudev *dev, int blocknum)
+{
+	if (blocknum < 1) {
+		printf("A streamed volume needs its number of blocks\n");
+		return -1;
+	}
+	fflush(stdout);
+	dev->fd = dup(STDOUT_FILENO);
+	if (dev->fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+		printf("Cannot redirect standard output\n");
+		return -1;
+	}
+	dev->isblk = 0;
+	dev->size = (off_t)blocknum * VMU_BLOCKSIZE;
+	dev->logical = VMU_BLOCKSIZE;
+	dev->physical = VMU_BLOCKSIZE;
+	return 0;
+}
+
+/*
+ * Throw away the old contents of an image file and extend it back out
+ * as one hole, so only the non-zero blocks ever need writing.
+ */
+static int make_sparse(int device_numb, off_t size)
+{
+	if (ftruncate(device_numb, 0) < 0 || ftruncate(device_numb, size) < 0) {
+		printf("Could not resize image file\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* With -F ordered the root block waits for everything before it */
+static int commit_system_image(const struct vmuopts *opts,
+	struct vmudev *dev, const struct vmuimage *image, unsigned int from)
+{
+	if (opts->durability == DURABLE_ORDERED)
+		return vmufat_write_system_image_ordered(dev, image, from);
+	return vmufat_write_system_image(dev, image, from);
 }
 
-static int mark_bad_blocks(int device_numb, struct badblocklist *root, 
-	const struct vmuparam *param, int verbose)
+/* Every target of a batch is formatted the same way */
+static int format_target(struct batchjob *job, struct vmutarget *target)
 {
-	int error = 0;
-	int nobadblock;
-	struct badblocklist *next;
-	
+	const struct vmuopts *opts = job->opts;
+	const char *device_name = target->device_name;
+	const char *sourcedir = target->sourcedir ? target->sourcedir
+		: opts->sourcedir;
+	int blocknum = target->blocknum ? target->blocknum : opts->blocknum;
+	unsigned int align, lowest, from, datablocks;
+	int nfiles = 0;
+	struct srcfile *files = NULL;
+	int stream = 0;
+	int error = -1, device_numb, status;
+	unsigned int written;
+	off_t mismatch;
+	struct stat statbuf;
+	struct vmubadblocks badblocks;
+	struct vmuparam params;
+	struct vmuimage image;
+	const struct vmuimage *golden;
+	struct vmuring ring;
+	struct vmubuffers buffers;
+	struct vmudev dev = { .ring = NULL, .buffers = NULL };
+	struct vmubench *timing = NULL;
 
-	if (!root)
+	if (opts->benchmark || opts->statsname)
+		timing = &target->bench;
+
+	if (blocknum < 0 || blocknum > VMU_MAXBLOCKS) {
+		printf("A VMUFAT volume has at most %u blocks\n",
+			VMU_MAXBLOCKS);
 		goto out;
+	}
 
-	next = root;
-	while (next) {
-		nobadblock = next->number;
-		if (nobadblock < 0 || nobadblock > param->rootblock)
-			goto advance;
-		if (nobadblock >= param->dirstart
-			&& nobadblock <= param->rootblock) {
-			printf("Format fails as system block is bad\n");
-			error = -1;
+	/* '-' streams the volume to standard output */
+	if (strcmp(device_name, "-") == 0) {
+		if (opts->scanbadblocks || opts->sparse || opts->verify
+			|| opts->quick || opts->depth || opts->direct
+			|| opts->rewrite || opts->durability > DURABLE_NONE) {
+			printf("-c, -w, -S, -V, -q, -D, -u, -x, -r and -F need a"
+				" seekable device\n");
 			goto out;
 		}
-		if (_mark_block_bad(device_numb, nobadblock, param)
-			< 0) {
-			printf("Format fails as cannot mark FAT"
-				" for bad block.\n");
-			error = -1;
+		if (open_stream(&dev, blocknum) < 0)
 			goto out;
+		device_numb = dev.fd;
+		stream = 1;
+		goto calculate;
+	}
+
+	if (checkmount(job->mounts, device_name) < 0)
+		goto out;
+
+	/* A sparse image can be created from nothing */
+	device_numb = open(device_name, (opts->sparse ? O_RDWR | O_CREAT
+		: O_RDWR) | (opts->direct ? O_DIRECT : 0), 0666);
+	if (device_numb < 0) {
+		printf("Attempting to open %s fails with error %i\n",
+			device_name, device_numb);
+		goto out;
+	}
+	dev.fd = device_numb;
+	dev.direct = opts->direct;
+
+	if (stat(device_name, &statbuf) < 0) {
+		printf("Cannot get status of %s\n", device_name);
+		goto close;
+	}
+	if (opts->allowfile < 1 && !S_ISBLK(statbuf.st_mode)) {
+		printf("%s must be a block device\n", device_name);
+		goto close;
+	}
+	if (opts->sparse > 0) {
+		if (!S_ISREG(statbuf.st_mode)) {
+			printf("%s must be a regular file for a sparse image\n",
+				device_name);
+			goto close;
 		}
-advance:
-		next = next->next;
+		if (make_sparse(device_numb, blocknum ?
+			(off_t)blocknum * VMU_BLOCKSIZE : statbuf.st_size) < 0)
+			goto close;
 	}
 
-	if (verbose)
-		printf("Bad blocks now marked off in FAT.\n");
+calculate:
+	bench_begin(timing, &dev);
+	if (stream < 1 && vmufat_probe_device(&dev) < 0) {
+		printf("Could not stat device.\n");
+		goto close;
+	}
+	if (calculate_vmuparams(&dev, &params, blocknum) < 0) {
+		if (dev.size < VMU_BLOCKSIZE * 4 || blocknum < 4)
+			printf("Device just %lu octets in size. Too small for"
+				" VMUFAT volume\n", dev.size);
+		else
+			printf("Device only %lu octets in size. Too small for"
+				" your request of %i blocks\n", dev.size,
+				blocknum);
+		goto close;
+	}
+	bench_end(timing, &dev, "calculate_vmuparams");
+	if (opts->verbose)
+		print_vmuparams(&dev, &params);
+
+	if (opts->sparse > 0 && ftruncate(device_numb, params.size) < 0) {
+		printf("Could not resize image file\n");
+		goto close;
+	}
+
+	if (opts->depth > 0) {
+		if (vmufat_open_ring(&ring, opts->depth) < 0)
+			printf("io_uring unavailable - using synchronous I/O\n");
+		else
+			dev.ring = &ring;
+	}
+
+	/* Direct I/O needs aligned buffers; map them once for the lot */
+	if (opts->direct) {
+		if (vmufat_open_buffers(&buffers, &dev) < 0) {
+			printf("Memory allocation failed.\n");
+			goto unring;
+		}
+		dev.buffers = &buffers;
+	}
+
+	if (vmufat_init_badblocks(&badblocks,
+		params.size >> VMU_BLOCKSHIFT) < 0) {
+		printf("Memory allocation failed.\n");
+		goto unbuffer;
+	}
+
+	if (opts->scanbadblocks > 0) {
+		bench_begin(timing, &dev);
+		/* Several scans at once would fight over one status line */
+		if (scan_volume(&dev, &badblocks, device_name, opts->journal,
+			opts->destructive, opts->verbose,
+			job->targets == 1 && isatty(STDOUT_FILENO)) < 0)
+			goto forget;
+		bench_end(timing, &dev,
+			opts->destructive ? "writetest" : "scanforbad");
+	}
+	else if (opts->useblocklist > 0) {
+		bench_begin(timing, NULL);
+		if (readforbad(&badblocks, opts->blocklistfnm,
+			opts->verbose) < 0)
+			goto forget;
+		bench_end(timing, NULL, "readforbad");
+	}
+
+	golden = get_golden_image(job, &params, timing);
+	if (!golden)
+		goto forget;
+
+	lowest = golden->firstblock;
+	if (sourcedir) {
+		if (readsourcedir(sourcedir, &files, &nfiles,
+			&datablocks) < 0)
+			goto forget;
+		lowest = vmufat_data_base(&params, &badblocks, datablocks);
+		if (lowest == UINT_MAX) {
+			printf("Files in %s need %u blocks - too many for the"
+				" volume\n", sourcedir, datablocks);
+			goto forget;
+		}
+	}
 
+	align = dev.physical / VMU_BLOCKSIZE;
+	if (build_system_image(&image, golden, &params, &badblocks, lowest,
+		align, timing, opts->verbose) < 0)
+		goto forget;
+
+	if (sourcedir) {
+		bench_begin(timing, NULL);
+		if (populate_image(&image, &params, sourcedir, files,
+			nfiles, lowest, opts->verbose) < 0)
+			goto release;
+		bench_end(timing, NULL, "populate_image");
+	}
+
+	if (stream > 0) {
+		bench_begin(timing, &dev);
+		if (vmufat_stream_volume(&dev, &image) < 0) {
+			printf("Write failed on output stream\n");
+			goto release;
+		}
+		bench_end(timing, &dev, "stream_volume");
+		if (opts->verbose)
+			printf("Volume streamed\n");
+	}
+	/* The image starts out as a hole, so skip the zeroes */
+	else if (opts->sparse > 0) {
+		bench_begin(timing, &dev);
+		from = sourcedir ? image.firstblock
+			: (params.dirstart + 1) / align * align;
+		if (commit_system_image(opts, &dev, &image, from) < 0) {
+			printf("Could not write system blocks\n");
+			goto release;
+		}
+		bench_end(timing, &dev, "write_system_image");
+		if (opts->verbose)
+			printf("System blocks %i to %i written\n", from,
+				image.firstblock + image.blocks - 1);
+	}
+	/* Only what differs from the new volume, then; -q spares user blocks */
+	else if (opts->rewrite > 0) {
+		bench_begin(timing, &dev);
+		if (vmufat_rewrite_volume(&dev, &image, opts->quick < 1,
+			opts->durability == DURABLE_ORDERED, &written) < 0) {
+			printf("Could not rewrite %s\n", device_name);
+			goto release;
+		}
+		bench_end(timing, &dev, "rewrite_volume");
+		if (opts->verbose)
+			printf("%u of %u blocks rewritten\n", written,
+				opts->quick > 0 ? image.blocks
+				: image.firstblock + image.blocks);
+	}
+	else {
+		/* A quick format leaves the user area to the FAT */
+		if (opts->discard > 0) {
+			bench_begin(timing, &dev);
+			if (vmufat_discard_blocks(&dev, &image) < 0)
+				printf("Device does not support discard - user"
+					" blocks left as they are\n");
+			else if (opts->verbose)
+				printf("Other blocks discarded\n");
+			bench_end(timing, &dev, "discard_blocks");
+		}
+		else if (opts->quick < 1) {
+			bench_begin(timing, &dev);
+			status = zero_blocks(&dev, &image);
+			if (status < 0) {
+				printf(status == -ENOMEM ? "Memory allocation"
+					" failed.\n" : "Write failed on device\n");
+				goto release;
+			}
+			bench_end(timing, &dev, "zero_blocks");
+			if (opts->verbose)
+				printf(status > 0 ? "Other blocks zeroed by"
+					" device\n" : "Other blocks zeroed\n");
+		}
+
+		/* The user area is settled before any metadata goes out */
+		if (opts->durability == DURABLE_ORDERED
+			&& (opts->discard > 0 || opts->quick < 1)) {
+			bench_begin(timing, &dev);
+			if (vmufat_sync_device(&dev) < 0) {
+				printf("Could not flush %s\n", device_name);
+				goto release;
+			}
+			bench_end(timing, &dev, "fsync");
+		}
+
+		bench_begin(timing, &dev);
+		if (commit_system_image(opts, &dev, &image,
+			image.firstblock) < 0) {
+			printf("Could not write system blocks\n");
+			goto release;
+		}
+		bench_end(timing, &dev, "write_system_image");
+		if (opts->verbose)
+			printf("System blocks %i to %i written\n",
+				image.firstblock,
+				image.firstblock + image.blocks - 1);
+	}
+
+	if (opts->verify > 0) {
+		bench_begin(timing, &dev);
+		status = vmufat_verify_volume(&dev, &image,
+			opts->sparse > 0 || opts->quick < 1, &mismatch);
+		if (status == -EILSEQ) {
+			printf("Verify fails at block %lu, octet 0x%lx\n",
+				(unsigned long)(mismatch / VMU_BLOCKSIZE),
+				(unsigned long)(mismatch % VMU_BLOCKSIZE));
+			goto release;
+		}
+		else if (status < 0) {
+			printf("Could not read volume back to verify it\n");
+			goto release;
+		}
+		bench_end(timing, &dev, "verify_volume");
+		if (opts->verbose)
+			printf("Volume verified\n");
+	}
+
+	/*
+	 * One flush for the lot with -F sync or ordered, and with -s unless
+	 * -F says otherwise, so its figures include getting to the media
+	 */
+	if ((opts->durability > DURABLE_NONE || (opts->statsname
+		&& opts->durability == DURABLE_DEFAULT)) && stream < 1) {
+		bench_begin(timing, &dev);
+		if (vmufat_sync_device(&dev) < 0) {
+			printf("Could not flush %s\n", device_name);
+			goto release;
+		}
+		bench_end(timing, &dev, "fsync");
+	}
+
+	if (opts->verbose)
+		printf("VMUFAT volume created on %s\n", device_name);
+	error = 0;
+release:
+	clean_system_image(&image);
+forget:
+	free(files);
+	vmufat_clean_badblocks(&badblocks);
+unbuffer:
+	if (dev.buffers)
+		vmufat_close_buffers(dev.buffers);
+unring:
+	if (dev.ring)
+		vmufat_close_ring(dev.ring);
+close:
+	close(device_numb);
 out:
 	return error;
-}	
+}
+
+static void *_batch_worker(void *arg)
+{
+	struct batchjob *job = arg;
+	struct vmutarget *target;
+	struct timespec began;
+
+	while (1) {
+		pthread_mutex_lock(&job->lock);
+		if (job->next >= job->targets) {
+			pthread_mutex_unlock(&job->lock);
+			break;
+		}
+		target = &job->target[job->next++];
+		pthread_mutex_unlock(&job->lock);
+
+		clock_gettime(CLOCK_MONOTONIC, &began);
+		target->error = format_target(job, target);
+		target->seconds = vmufat_elapsed_seconds(&began);
+	}
+	return NULL;
+}
+
+/* Append a target to the array, which grows as needed */
+static int _add_target(struct vmutarget **target, int *targets, int *room,
+	const char *device_name, int blocknum, const char *sourcedir)
+{
+	struct vmutarget *grown, *added;
+
+	if (*targets >= *room) {
+		*room = *room ? *room * 2 : 16;
+		grown = realloc(*target, *room * sizeof(struct vmutarget));
+		if (!grown)
+			goto nomemory;
+		*target = grown;
+	}
+	added = &(*target)[*targets];
+	memset(added, 0, sizeof(*added));
+	added->blocknum = blocknum;
+	if (!(added->device_name = strdup(device_name)))
+		goto nomemory;
+	if (sourcedir && !(added->sourcedir = strdup(sourcedir))) {
+		free(added->device_name);
+		goto nomemory;
+	}
+	(*targets)++;
+	return 0;
+
+nomemory:
+	printf("Memory allocation failed.\n");
+	return -1;
+}
+
+/*
+ * Targets for the batch, one per line as "target [blocks [directory]]",
+ * so each image can have its own size and -d payload; a blocks of "-"
+ * leaves the size to -N or -B. Blank and '#' lines are skipped.
+ */
+static int readmanifest(const char *filename, struct vmutarget **target,
+	int *targets, int *room)
+{
+	FILE *manifest;
+	char line[PATH_MAX * 2 + 32];
+	char *name, *blocks, *dir, *rest, *end;
+	int error = -1, lineno = 0, blocknum;
+
+	manifest = fopen(filename, "r");
+	if (!manifest) {
+		printf("Could not open %s\n", filename);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), manifest)) {
+		lineno++;
+		/* Cut short by fgets, and the rest would read as a target */
+		if (!strchr(line, '\n') && !feof(manifest)) {
+			printf("Line %i of %s is too long\n", lineno, filename);
+			goto close;
+		}
+		if (line[0] == '#')
+			continue;
+		if (!(name = strtok_r(line, " \t\r\n", &rest)))
+			continue;
+		blocks = strtok_r(NULL, " \t\r\n", &rest);
+		dir = strtok_r(NULL, " \t\r\n", &rest);
+		blocknum = 0;
+		if (blocks && strcmp(blocks, "-") != 0) {
+			blocknum = strtol(blocks, &end, 10);
+			if (*end || blocknum < 1)
+				goto bad;
+		}
+		if (strtok_r(NULL, " \t\r\n", &rest))
+			goto bad;
+		if (_add_target(target, targets, room, name, blocknum, dir) < 0)
+			goto close;
+	}
+	error = 0;
+	goto close;
+
+bad:
+	printf("Cannot parse %s at line %i\n", filename, lineno);
+close:
+	fclose(manifest);
+	return error;
+}
 
 int main(int argc, char* argv[])
 {
-	int blocknum = 0;
-	int i;
-	int verbose = 0, scanbadblocks = 0, useblocklist = 0, allowfile = 0;
-	int error = 1, device_numb;
-	char *blocklistfnm = NULL;
-	char *device_name = NULL;
-	struct stat statbuf;
-	struct badblocklist* lstbadblocks = NULL;
-	struct vmuparam params;
+	int i, jobs = 0, threads, batch = 0;
+	int error = 1;
+	int targets = 0, room = 0;
+	char *manifest = NULL;
+	pthread_t *worker = NULL;
+	struct goldenimage *golden;
+	struct vmutarget *target = NULL;
+	struct vmuopts opts = { .blocknum = 0 };
+	struct mountindex mounts = { .dev = NULL };
+	struct batchjob job = {
+		.opts = &opts,
+		.next = 0,
+		.golden = NULL,
+		.mounts = &mounts,
+	};
 
 	if (argc < 2) {
 		usage();
@@ -508,26 +1809,89 @@ int main(int argc, char* argv[])
 	}
 
 	opterr = 0;
-	while ((i = getopt(argc, argv, "cl:N:B:vf")) != -1)
+	while ((i = getopt(argc, argv, "cl:N:B:vfSu:bs:G:VqDJ:wj:m:d:xrF:")) != -1)
 		switch (i) {
 		case 'c':
-			scanbadblocks = 1;
+			opts.scanbadblocks = 1;
 			break;
 		case 'l':
-			useblocklist = 1;
-			blocklistfnm = optarg;
+			opts.useblocklist = 1;
+			opts.blocklistfnm = optarg;
 			break;
 		case 'N':
-			blocknum = atoi(optarg);
+			opts.blocknum = atoi(optarg);
 			break;
 		case 'B':
-			blocknum = 1 << atoi(optarg);
+			opts.blocknum = 1 << atoi(optarg);
 			break;
 		case 'v':
-			verbose = 1;
+			opts.verbose = 1;
 			break;
 		case 'f':
-			allowfile = 1;
+			opts.allowfile = 1;
+			break;
+		case 'S':
+			opts.sparse = 1;
+			opts.allowfile = 1;
+			break;
+		case 'u':
+			opts.depth = atoi(optarg);
+			break;
+		case 'b':
+			opts.benchmark = 1;
+			break;
+		case 's':
+			opts.statsname = optarg;
+			break;
+		case 'G':
+			opts.cachedir = optarg;
+			break;
+		case 'V':
+			opts.verify = 1;
+			break;
+		case 'q':
+			opts.quick = 1;
+			break;
+		case 'D':
+			opts.quick = 1;
+			opts.discard = 1;
+			break;
+		case 'J':
+			opts.scanbadblocks = 1;
+			opts.journal = optarg;
+			break;
+		case 'w':
+			opts.scanbadblocks = 1;
+			opts.destructive = 1;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			batch = 1;
+			break;
+		case 'm':
+			manifest = optarg;
+			batch = 1;
+			break;
+		case 'd':
+			opts.sourcedir = optarg;
+			break;
+		case 'x':
+			opts.direct = 1;
+			break;
+		case 'r':
+			opts.rewrite = 1;
+			break;
+		case 'F':
+			if (strcmp(optarg, "none") == 0)
+				opts.durability = DURABLE_NONE;
+			else if (strcmp(optarg, "sync") == 0)
+				opts.durability = DURABLE_SYNC;
+			else if (strcmp(optarg, "ordered") == 0)
+				opts.durability = DURABLE_ORDERED;
+			else {
+				usage();
+				goto out;
+			}
 			break;
 		default:
 			usage();
@@ -535,71 +1899,92 @@ int main(int argc, char* argv[])
 		}
 	argc -= optind;
 	argv += optind;
-	if (!argc > 0) {
-		usage();
-		goto out;
-	}
-	device_name = argv[0];
-	argc--;
-	argv++;
 
-	if (argc) {
-		blocknum = atoi(argv[0]);
-		if (argc > 1)
+	/* A batch takes every argument as a target, sized by -N or -B */
+	if (batch) {
+		if (manifest && readmanifest(manifest, &target, &targets,
+			&room) < 0)
+			goto release;
+		for (i = 0; i < argc; i++)
+			if (_add_target(&target, &targets, &room, argv[i], 0,
+				NULL) < 0)
+				goto release;
+		for (i = 0; i < targets; i++)
+			if (strcmp(target[i].device_name, "-") == 0) {
+				printf("A batch cannot stream to standard"
+					" output\n");
+				goto release;
+			}
+		if (opts.journal && targets > 1) {
+			printf("-J needs a single target\n");
+			goto release;
+		}
+	}
+	else if (argc > 0) {
+		if (_add_target(&target, &targets, &room, argv[0],
+			argc > 1 ? atoi(argv[1]) : 0, NULL) < 0)
+			goto release;
+		if (argc > 2)
 			usage();
 	}
+	if (!targets) {
+		usage();
+		goto release;
+	}
+	job.target = target;
+	job.targets = targets;
+	if (build_mountindex(&mounts) < 0)
+		printf("Cannot read the mount table - not checking for"
+			" mounted targets\n");
 
-	if (checkmount(device_name) < 0)
-		goto out;
+	if (jobs < 1)
+		jobs = 1;
+	if (jobs > targets)
+		jobs = targets;
+	pthread_mutex_init(&job.lock, NULL);
+	threads = 0;
+	if (jobs > 1 && (worker = malloc(jobs * sizeof(pthread_t))))
+		for (; threads < jobs; threads++)
+			if (pthread_create(&worker[threads], NULL,
+				_batch_worker, &job) != 0)
+				break;
+	/* One at a time from here if there are no threads to be had */
+	if (!threads)
+		_batch_worker(&job);
+	for (i = 0; i < threads; i++)
+		pthread_join(worker[i], NULL);
+	pthread_mutex_destroy(&job.lock);
 
-	device_numb = open(device_name, O_RDWR);
-	if (device_numb < 0) {
-		printf("Attempting to open %s fails with error %i\n",
-			device_name, device_numb);
-		goto out;
+	error = 0;
+	for (i = 0; i < targets; i++) {
+		if (target[i].error)
+			error = 1;
+		if (batch)
+			printf("%s: %s in %.3f seconds\n", target[i].device_name,
+				target[i].error ? "failed" : "formatted",
+				target[i].seconds);
+		if (opts.benchmark > 0) {
+			if (batch)
+				printf("%s:\n", target[i].device_name);
+			bench_report(&target[i].bench);
+		}
 	}
+	if (opts.statsname)
+		write_stats(opts.statsname, target, targets, batch);
 
-	if (stat(device_name, &statbuf) < 0) {
-		printf("Cannot get status of %s\n", device_name);
-		goto out;
-	}
-	if (allowfile < 1 && !S_ISBLK(statbuf.st_mode)) {
-		printf("%s must be a block device\n", device_name);
-		goto out;
+release:
+	while ((golden = job.golden)) {
+		job.golden = golden->next;
+		clean_system_image(&golden->image);
+		free(golden);
 	}
-	
-	if (scanbadblocks > 0) {
-		if (scanforbad(device_numb, &lstbadblocks, verbose) < 0)
-			goto close;
-	}
-	else if (useblocklist > 0) {
-		if (readforbad(&lstbadblocks, blocklistfnm, verbose) < 0)
-			goto close;
+	for (i = 0; i < targets; i++) {
+		free(target[i].device_name);
+		free(target[i].sourcedir);
 	}
-
-	if (calculate_vmuparams(device_numb, &params, blocknum, verbose) < 0)
-		goto close;
-
-	if (mark_root_block(device_numb, &params, verbose) < 0)
-		goto close;
-
-	if (mark_fat(device_numb, &params, verbose) < 0)
-		goto close;
-
-	if (zero_blocks(device_numb, &params, verbose) < 0)
-		goto close;
-
-	if (mark_bad_blocks(device_numb, lstbadblocks, &params, verbose) < 0)
-		goto close;
-
-	if (verbose)
-		printf("VMUFAT volume created on %s\n", device_name);
-		
-	error = 0;
-close:
-	close(device_numb);
-	if (lstbadblocks)
-		clean_blocklist(lstbadblocks);
+	free(target);
+	free(worker);
+	clean_mountindex(&mounts);
 out:
 	return error;
 }